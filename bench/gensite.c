@@ -0,0 +1,319 @@
+/*
+ * gensite: writes a synthetic lacy site for benchmarking. The same
+ * parameters and seed always produce the same site.
+ *
+ *   gensite [-p pages] [-m mkd%] [-d depth] [-i includes] [-l loop]
+ *           [-s shell] [-r seed] DIR
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* must stay below MAX_INHERIT in lacy.c, the page itself is on the stack */
+#define MAX_DEPTH   49
+#define INC_FILES   8
+
+static void usage(void);
+static void fatal(const char *fmt, const char *arg);
+static int  number(const char *s, int max);
+static uint32_t rnd(void);
+static void subdir(const char *dir, const char *name);
+static FILE *create(const char *dir, const char *name);
+static void words(FILE *f, int n, bool mkd);
+static void gen_layouts(const char *dir);
+static void gen_includes(const char *dir);
+static void gen_posts(const char *dir);
+static void gen_page(const char *dir, int n);
+
+static int pages = 1000;
+static int mkd_percent = 50;
+static int depth = 3;
+static int includes = 2;
+static int loop_size = 20;
+static int shell_blocks = 1;
+static uint32_t seed = 1;
+
+static const char *dict[] = {
+    "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing",
+    "elit", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore",
+    "et", "dolore", "magna", "aliqua", "enim", "ad", "minim", "veniam",
+    "quis", "nostrud", "exercitation", "ullamco", "laboris", "nisi",
+    "aliquip", "ex", "ea", "commodo", "consequat", "duis", "aute", "irure",
+    "in", "reprehenderit", "voluptate", "velit", "esse", "cillum", "fugiat",
+    "nulla", "pariatur", "excepteur", "sint", "occaecat", "cupidatat",
+    "non", "proident", "sunt", "culpa", "qui", "officia", "deserunt",
+    "mollit", "anim", "id", "est", "laborum"
+};
+
+int
+main(int argc, char **argv)
+{
+    int c, i;
+    const char *dir;
+
+    while (-1 != (c = getopt(argc, argv, "p:m:d:i:l:s:r:h"))) {
+        switch (c) {
+            case 'p':
+                pages = number(optarg, 1000000);
+                break;
+            case 'm':
+                mkd_percent = number(optarg, 100);
+                break;
+            case 'd':
+                depth = number(optarg, MAX_DEPTH);
+                break;
+            case 'i':
+                includes = number(optarg, 1000);
+                break;
+            case 'l':
+                loop_size = number(optarg, 1000000);
+                break;
+            case 's':
+                shell_blocks = number(optarg, 1000);
+                break;
+            case 'r':
+                seed = (uint32_t)number(optarg, INT32_MAX);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind + 1 != argc)
+        usage();
+    dir = argv[optind];
+    if (0 == seed)
+        seed = 1;
+
+    if (0 != mkdir(dir, 0755) && EEXIST != errno)
+        fatal("can't create %s", dir);
+
+    subdir(dir, "_static");
+    fclose(create(dir, "_static/site.css"));
+    gen_layouts(dir);
+    gen_includes(dir);
+    gen_posts(dir);
+    for (i = 0; i < pages; i++)
+        gen_page(dir, i);
+
+    return EXIT_SUCCESS;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+"Usage: gensite [options] DIR\n\
+  -p N   pages (1000)\n\
+  -m N   percent of pages written in markdown (50)\n\
+  -d N   layouts inherited by every page, at most %d (3)\n\
+  -i N   includes per page (2)\n\
+  -l N   files in the directory each page loops over, 0 for no loop (20)\n\
+  -s N   shell blocks per page (1)\n\
+  -r N   random seed (1)\n", MAX_DEPTH);
+    exit(EXIT_FAILURE);
+}
+
+static void
+fatal(const char *fmt, const char *arg)
+{
+    fprintf(stderr, "gensite: ");
+    fprintf(stderr, fmt, arg);
+    fprintf(stderr, ": %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static int
+number(const char *s, int max)
+{
+    char *end;
+    long n = strtol(s, &end, 10);
+
+    if ('\0' == *s || '\0' != *end || n < 0 || n > max) {
+        fprintf(stderr, "gensite: %s is not a number between 0 and %d\n",
+                s, max);
+        exit(EXIT_FAILURE);
+    }
+    return (int)n;
+}
+
+/* xorshift32, libc rand() differs between systems */
+static uint32_t
+rnd(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static void
+subdir(const char *dir, const char *name)
+{
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (0 != mkdir(path, 0755) && EEXIST != errno)
+        fatal("can't create %s", path);
+}
+
+static FILE *
+create(const char *dir, const char *name)
+{
+    char path[4096];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (NULL == (f = fopen(path, "w")))
+        fatal("can't create %s", path);
+    return f;
+}
+
+/* n words of filler, in sentences */
+static void
+words(FILE *f, int n, bool mkd)
+{
+    int i;
+    const char *w;
+
+    for (i = 0; i < n; i++) {
+        w = dict[rnd() % (sizeof(dict) / sizeof(dict[0]))];
+        if (mkd && 0 == rnd() % 16)
+            fprintf(f, "%s*%s*", 0 == i ? "" : " ", w);
+        else if (0 == i)
+            fprintf(f, "%c%s", w[0] - 'a' + 'A', w + 1);
+        else
+            fprintf(f, " %s", w);
+        if (i + 1 < n && 0 == rnd() % 12)
+            fputc(',', f);
+    }
+    fputs(".\n", f);
+}
+
+/* layouts/l1.html inherits layouts/l2.html and so on up to depth */
+static void
+gen_layouts(const char *dir)
+{
+    char name[64];
+    int i;
+    FILE *f;
+
+    if (0 == depth)
+        return;
+    subdir(dir, "layouts");
+
+    for (i = 1; i <= depth; i++) {
+        snprintf(name, sizeof(name), "layouts/l%d.html", i);
+        f = create(dir, name);
+        if (i < depth)
+            fprintf(f, "---\ninherits: layouts/l%d.html\n---\n", i + 1);
+        if (i == depth) {
+            fputs("<!DOCTYPE html>\n<html>\n<head>\n"
+                  "<title>{{ title }}</title>\n"
+                  "<link rel=\"stylesheet\" href=\"{{ root }}/site.css\">\n"
+                  "</head>\n<body>\n", f);
+        }
+        fprintf(f, "<div class=\"l%d\">\n<p>", i);
+        words(f, 10 + rnd() % 20, false);
+        fputs("</p>\n<a href=\"{{ root }}/index.html\">{{ this.title }}</a>\n"
+              "{{ content }}\n</div>\n", f);
+        if (i == depth)
+            fputs("</body>\n</html>\n", f);
+        fclose(f);
+    }
+}
+
+static void
+gen_includes(const char *dir)
+{
+    char name[64];
+    int i;
+    FILE *f;
+
+    if (0 == includes)
+        return;
+    subdir(dir, "inc");
+
+    for (i = 0; i < INC_FILES; i++) {
+        snprintf(name, sizeof(name), "inc/i%d.html", i);
+        f = create(dir, name);
+        fprintf(f, "---\ntitle: Include %d\n---\n<aside>", i);
+        words(f, 20 + rnd() % 40, false);
+        fputs("</aside>\n", f);
+        fclose(f);
+    }
+}
+
+/* the directory every page loops over */
+static void
+gen_posts(const char *dir)
+{
+    char name[64];
+    int i;
+    FILE *f;
+
+    if (0 == loop_size)
+        return;
+    subdir(dir, "posts");
+
+    for (i = 0; i < loop_size; i++) {
+        snprintf(name, sizeof(name), "posts/%06d.txt", i);
+        f = create(dir, name);
+        words(f, 5 + rnd() % 50, false);
+        fclose(f);
+    }
+}
+
+static void
+gen_page(const char *dir, int n)
+{
+    char name[64];
+    int i, paras;
+    bool mkd = (int)(rnd() % 100) < mkd_percent;
+    FILE *f;
+
+    if (0 == n)
+        subdir(dir, "pages");
+    snprintf(name, sizeof(name), "pages/%06d.%s", n, mkd ? "mkd" : "html");
+    f = create(dir, name);
+
+    fputs("---\n", f);
+    if (depth > 0)
+        fputs("inherits: layouts/l1.html\n", f);
+    fprintf(f, "title: Page %d\n---\n", n);
+
+    if (mkd)
+        fprintf(f, "Page %d\n=======\n\n", n);
+    else
+        fputs("<h1>{{ title }}</h1>\n", f);
+
+    paras = 3 + rnd() % 6;
+    for (i = 0; i < paras; i++) {
+        if (!mkd)
+            fputs("<p>", f);
+        words(f, 40 + rnd() % 80, mkd);
+        fputs(mkd ? "\n" : "</p>\n", f);
+    }
+    if (mkd) {
+        for (i = 0; i < 3; i++) {
+            fputs("* ", f);
+            words(f, 3 + rnd() % 8, mkd);
+        }
+        fputc('\n', f);
+    }
+
+    for (i = 0; i < includes; i++)
+        fprintf(f, "{%% include inc/i%u.html %%}\n", rnd() % INC_FILES);
+    if (loop_size > 0) {
+        fputs("<ul>\n{% for f in posts do %}\n"
+              "<li>{{ f }} {{ f.size }}</li>\n{% done %}\n</ul>\n", f);
+    }
+    for (i = 0; i < shell_blocks; i++)
+        fprintf(f, "<p>{$ echo %d.%d $}</p>\n", n, i);
+
+    fclose(f);
+}
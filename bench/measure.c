@@ -0,0 +1,171 @@
+/*
+ * measure: runs a command and prints its wall time in seconds, peak RSS in
+ * KB and, with -t, the number of system calls made by it and every thread
+ * and process it started (-1 when ptrace is not permitted).
+ *
+ *   measure [-t] command [args...]
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* one bit per possible tid, set while the thread is inside a syscall */
+#define TID_MAX     (1 << 22)
+
+static double now(void);
+static pid_t start(char **argv, bool trace);
+static int  run(pid_t child, struct rusage *ru);
+static int  run_traced(pid_t child, struct rusage *ru, long *calls);
+
+int
+main(int argc, char **argv)
+{
+    int c, status;
+    bool trace = false;
+    long calls = -1;
+    double t0, t1;
+    pid_t child;
+    struct rusage ru;
+
+    while (-1 != (c = getopt(argc, argv, "+t"))) {
+        switch (c) {
+            case 't':
+                trace = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: measure [-t] command [args...]\n");
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: measure [-t] command [args...]\n");
+        return EXIT_FAILURE;
+    }
+
+    t0 = now();
+    child = start(argv + optind, trace);
+    if (trace)
+        status = run_traced(child, &ru, &calls);
+    else
+        status = run(child, &ru);
+    t1 = now();
+
+    if (!WIFEXITED(status) || 0 != WEXITSTATUS(status)) {
+        fprintf(stderr, "measure: %s failed\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    printf("%.3f %ld %ld\n", t1 - t0, ru.ru_maxrss, calls);
+    return EXIT_SUCCESS;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static pid_t
+start(char **argv, bool trace)
+{
+    pid_t pid = fork();
+
+    if (-1 == pid) {
+        perror("measure: fork");
+        exit(EXIT_FAILURE);
+    }
+    if (0 == pid) {
+        if (trace && 0 == ptrace(PTRACE_TRACEME, 0, NULL, NULL))
+            raise(SIGSTOP);
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+static int
+run(pid_t child, struct rusage *ru)
+{
+    int status;
+
+    while (-1 == wait4(child, &status, 0, ru)) {
+        if (EINTR != errno) {
+            perror("measure: wait");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return status;
+}
+
+/*
+ * A traced thread stops on entry to and exit from every syscall, except
+ * exit which never returns, so the stops of one thread alternate.
+ */
+static int
+run_traced(pid_t child, struct rusage *ru, long *calls)
+{
+    int status, child_status = 0, sig;
+    long opts = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE
+              | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK
+              | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL;
+    uint8_t *inside = calloc(TID_MAX / 8, 1);
+    pid_t pid;
+    struct rusage r;
+
+    /* the child stops itself when tracing works and just runs otherwise */
+    if (-1 == waitpid(child, &status, 0) || !WIFSTOPPED(status)) {
+        *calls = -1;
+        *ru = (struct rusage){0};
+        free(inside);
+        return status;
+    }
+    ptrace(PTRACE_SETOPTIONS, child, NULL, (void *)opts);
+    ptrace(PTRACE_SYSCALL, child, NULL, NULL);
+
+    *calls = 0;
+    while (-1 != (pid = wait4(-1, &status, __WALL, &r))) {
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            inside[pid % TID_MAX / 8] &= ~(1 << pid % 8);
+            if (pid == child) {
+                child_status = status;
+                *ru = r;
+            }
+            continue;
+        }
+        if (!WIFSTOPPED(status))
+            continue;
+
+        sig = WSTOPSIG(status);
+        if ((SIGTRAP | 0x80) == sig) {
+            if (!(inside[pid % TID_MAX / 8] & 1 << pid % 8))
+                (*calls)++;
+            inside[pid % TID_MAX / 8] ^= 1 << pid % 8;
+            sig = 0;
+        } else if (SIGTRAP == sig && 0 != status >> 16) {
+            /* clone, fork and exec events */
+            sig = 0;
+        } else if (SIGSTOP == sig) {
+            /* the initial stop of threads and processes attached above */
+            sig = 0;
+        }
+        ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)sig);
+    }
+    free(inside);
+    return child_status;
+}
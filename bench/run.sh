@@ -0,0 +1,99 @@
+#!/bin/sh
+#
+# run.sh: generates a synthetic site with bench/gensite and times a full
+# and a no-op build of it with bench/measure. The best of -n runs is
+# written to a JSON file, by default bench.json.
+#
+#   run.sh [-x lacy] [-o file] [-n runs] [-j jobs] [gensite options]
+
+set -e
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+lacy=$top/lacy
+out=bench.json
+runs=3
+jobs=1
+pages=1000 mkd=50 depth=3 includes=2 loop=20 shell=1 seed=1
+
+while getopts "x:o:n:j:p:m:d:i:l:s:r:" opt; do
+    case $opt in
+        x) lacy=$OPTARG ;;
+        o) out=$OPTARG ;;
+        n) runs=$OPTARG ;;
+        j) jobs=$OPTARG ;;
+        p) pages=$OPTARG ;;
+        m) mkd=$OPTARG ;;
+        d) depth=$OPTARG ;;
+        i) includes=$OPTARG ;;
+        l) loop=$OPTARG ;;
+        s) shell=$OPTARG ;;
+        r) seed=$OPTARG ;;
+        *) echo "Usage: run.sh [-x lacy] [-o file] [-n runs] [-j jobs]" \
+                "[-p pages] [-m mkd%] [-d depth] [-i includes] [-l loop]" \
+                "[-s shell] [-r seed]" >&2
+           exit 1 ;;
+    esac
+done
+
+case $lacy in /*) ;; *) lacy=$(pwd)/$lacy ;; esac
+case $out in /*) ;; *) out=$(pwd)/$out ;; esac
+commit=$(git -C "$top" rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+site=$(mktemp -d "${TMPDIR:-/tmp}/lacy-bench.XXXXXX")
+trap 'rm -rf "$site"' EXIT INT TERM
+"$top/bench/gensite" -p "$pages" -m "$mkd" -d "$depth" -i "$includes" \
+    -l "$loop" -s "$shell" -r "$seed" "$site"
+cd "$site"
+
+# prints "seconds rss syscalls" of the fastest of $runs builds, syscalls
+# come from one more traced build. A full build starts without _output.
+build() {
+    i=0 samples=
+    while [ $i -lt "$runs" ]; do
+        if [ full = "$1" ]; then
+            rm -rf _output
+        fi
+        samples="$samples$("$top/bench/measure" "$lacy" -q -j "$jobs" pages/*)
+"
+        i=$((i + 1))
+    done
+    if [ full = "$1" ]; then
+        rm -rf _output
+    fi
+    calls=$("$top/bench/measure" -t "$lacy" -q -j "$jobs" pages/* \
+            | cut -d' ' -f3)
+    if [ "$calls" -lt 0 ]; then
+        calls=null
+    fi
+    best=$(printf '%s' "$samples" | sort -n | head -n 1 | cut -d' ' -f1,2)
+    echo "$best $calls"
+}
+
+# the no-op build runs on the _output left by the last full build
+full=$(build full)
+noop=$(build noop)
+
+result() {
+    echo "$2" | awk -v pages="$pages" -v name="$1" '{
+        printf "  \"%s\": {\"seconds\": %s, \"pages_per_sec\": %.1f, " \
+               "\"max_rss_kb\": %s, \"syscalls\": %s}", name, $1,
+               ($1 > 0 ? pages / $1 : 0), $2, $3
+    }'
+}
+
+{
+    echo "{"
+    echo "  \"commit\": \"$commit\","
+    echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+    printf '  "params": {"pages": %s, "mkd_percent": %s, "depth": %s, ' \
+        "$pages" "$mkd" "$depth"
+    printf '"includes": %s, "loop": %s, "shell": %s, "seed": %s, ' \
+        "$includes" "$loop" "$shell" "$seed"
+    printf '"jobs": %s, "runs": %s},\n' "$jobs" "$runs"
+    result full "$full"
+    echo ","
+    result noop "$noop"
+    echo
+    echo "}"
+} > "$out"
+cat "$out"
@@ -1,18 +1,64 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
 #include <dirent.h>
+#include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/sendfile.h>
+#endif
+#include <arpa/inet.h>
+#include <netinet/in.h>
 
 #include "config.h"
 #include "markdown.h"
 
 #define MAX_INHERIT 50
+#define COPY_THREADS 4
+#define SH_JOBS     4
+#define STR_INLINE  32
+#define ARENA_PAGE  512
+#define ARENA_RENDER 16384
+#define ARENA_MAX   65536
+#define DEPS_FILE   ".lacy-deps"
+#define CACHE_DIR   ".lacy-cache"
+#define SH_INPUTS   "lacy-inputs:"
+#define DEPS_MAGIC  "lacy-deps 1"
+#define MKD_FLAGS   0
+#define NATIVE_ABI  "lacy-native 3"
+/* instructions per generated function, compilers choke on huge ones */
+#define NATIVE_CHUNK 256
+/* past this the straight line code loses to the interpreter */
+#define NATIVE_MAX  4096
+/* quiet period that ends a burst of file events, in ms */
+#define WATCH_SETTLE 30
+#define SERVE_REQUEST 8192
+#define STATS_SLOWEST 10
+/* nesting of timed phases on one thread, deeper ones are not timed */
+#define PHASE_DEPTH 64
 
 #define PACKAGE_NAME "lacy"
 #define PACKAGE_VERSION "0.0.2"
@@ -24,43 +70,216 @@
 #define env_has_next(env)      (env->p_stack->pos + 1 < env->p_stack->size)
 #define env_inc(env)           env->p_stack->pos++
 #define env_dec(env)           env->p_stack->pos--
+#define env_inherits(env)      (env->p_stack->size > 1)
 
+/* 
+ * growable string, short strings live in buf and need no allocation.
+ * s may point into the struct itself, so a ut_str must not be copied.
+ */
 struct ut_str {
     char *s;
-    long def_size;
-    long size;
-    long len;
+    size_t size;
+    size_t len;
+    char buf[STR_INLINE];
+};
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+/* bump allocator, everything is released at once */
+struct arena {
+    struct arena_block *head;
+    struct arena_block *cur;
+    size_t block_size;
 };
 
 enum { NORM, REF, HEADER };
 enum { NONE, MARKDOWN };
+enum { STATIC_COPY, STATIC_LINK, STATIC_SYMLINK };
+enum { ENGINE_TREE, ENGINE_VM };
 
 struct page_attr {
-    struct ut_str name;
-    struct ut_str value;
+    char *name;
+    char *value;
+    int slot;
     struct page_attr *next;
 };
 
+/* symbols interned before any template is compiled */
+enum { SYM_ROOT = 0, SYM_THIS, SYM_CONTENT, SYM_SIZE, SYM_MTIME };
+
+/* one name in a cached directory listing */
+struct dir_entry {
+    char *name;
+    /* directory and name, a page reading size or mtime depends on it */
+    char *path;
+    bool is_dir;
+    long long size;
+    long long mtime;
+};
+
+/* sorted listing of a directory, read once per run */
+struct dir_list {
+    int n;
+    struct dir_entry *entries;
+};
+
+/* record layout returned by getdents64 */
+struct lx_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct env_var {
+    char *value;
+    /* set when bound by a loop over a directory */
+    struct dir_entry *entry;
+};
+
+/* 
+ * Calls available to natively compiled layouts. NATIVE_HEADER declares
+ * the same struct for the generated code, both have to change together
+ * with NATIVE_ABI. Generated code appends to the leading fields of 
+ * struct ut_str itself and only calls grow() when the buffer is full, 
+ * values are looked up once and kept until a variable may have changed.
+ */
+struct native_rt {
+    void (*grow)(void *out, const char *s, size_t n);
+    const char *(*root)(void *env);
+    const char *(*self)(void *env);
+    int (*self_member)(void *env, int member, const char **value);
+    const char *(*var)(void *env, int slot);
+    int (*var_member)(void *env, int slot, int member, const char **value);
+    void (*content)(void *out, void *env);
+    void (*include)(void *out, void *env, void *page);
+    const char *(*sh)(const char *cmd, size_t *n);
+    void *(*loop_sh)(void *env, int slot, const char *cmd);
+    void *(*loop_dir)(void *env, int slot, const char *path);
+    int (*loop_next)(void *env, void *loop);
+};
+
+typedef void (*native_fn)(const struct native_rt *rt, void *out, void *env);
+
+#define NATIVE_HEADER \
+"#include <stddef.h>\n" \
+"#include <string.h>\n" \
+"#if defined(__GNUC__)\n" \
+"#define NOINLINE __attribute__((noinline))\n" \
+"#else\n" \
+"#define NOINLINE\n" \
+"#endif\n" \
+"#define S(i) ((i) < 0 ? -1 : lacy_slots[i])\n" \
+"#define RESET memset(v, 0, NV * sizeof(struct lacy_val))\n" \
+"struct lacy_out {\n" \
+"    char *s;\n" \
+"    size_t size;\n" \
+"    size_t len;\n" \
+"};\n" \
+"struct lacy_rt {\n" \
+"    void (*grow)(void *out, const char *s, size_t n);\n" \
+"    const char *(*root)(void *env);\n" \
+"    const char *(*self)(void *env);\n" \
+"    int (*self_member)(void *env, int member, const char **value);\n" \
+"    const char *(*var)(void *env, int slot);\n" \
+"    int (*var_member)(void *env, int slot, int member, " \
+"const char **value);\n" \
+"    void (*content)(void *out, void *env);\n" \
+"    void (*include)(void *out, void *env, void *page);\n" \
+"    const char *(*sh)(const char *cmd, size_t *n);\n" \
+"    void *(*loop_sh)(void *env, int slot, const char *cmd);\n" \
+"    void *(*loop_dir)(void *env, int slot, const char *path);\n" \
+"    int (*loop_next)(void *env, void *loop);\n" \
+"};\n" \
+"struct lacy_val {\n" \
+"    const char *s;\n" \
+"    size_t n;\n" \
+"    int state;\n" \
+"};\n" \
+"static void\n" \
+"put(const struct lacy_rt *rt, struct lacy_out *o, const char *s, " \
+"size_t n)\n" \
+"{\n" \
+"    if (0 == n)\n" \
+"        return;\n" \
+"    if (o->len + n < o->size) {\n" \
+"        memcpy(o->s + o->len, s, n);\n" \
+"        o->len += n;\n" \
+"        o->s[o->len] = '\\0';\n" \
+"    }\n" \
+"    else {\n" \
+"        rt->grow(o, s, n);\n" \
+"    }\n" \
+"}\n" \
+"static void\n" \
+"val(struct lacy_val *v, const char *s, int state)\n" \
+"{\n" \
+"    v->s = s;\n" \
+"    v->n = NULL != s ? strlen(s) : 0;\n" \
+"    v->state = state;\n" \
+"}\n"
+
+struct dep_stamp {
+    char *path;
+    long long mtime_sec;
+    long mtime_nsec;
+    long long size;
+};
+
 struct page {
     struct page *inherits;
     char *file_path;
+    char *src_path;
     char *code;
+    size_t code_len;
     int page_type;
 
+    /* 
+     * source file contents, code points into it unless the page is 
+     * markdown or text precedes the header
+     */
+    char *src;
+    size_t src_len;
+    bool src_mapped;
+    /* the source as it was read, path is src_path */
+    struct dep_stamp stamp;
+
     struct page_attr *attr_top;
+    /* attributes indexed by symbol slot */
+    struct page_attr **attr_slots;
+    int nattr_slots;
+
+    /* compiled template, built on first use and never modified */
+    struct tree_node *tree;
+    struct prog *prog;
+    /* layout compiled to a shared object, see page_native() */
+    native_fn native;
+    bool native_tried;
+    /* a page this one inherits is missing, reported as a syntax error */
+    char *err;
+
+    /* owns attributes and template nodes */
+    struct arena arena;
 
     struct page *next;
     struct page *prev;
 };
 
 static struct page * page_list;
+static struct page * page_tail;
 
 enum TOKENS { IDENT = 0, MEMBER, 
               BLOCK,
               EXP_START, EXP_END, 
               SH_START, SH_BLOCK, SH_END, 
               VAR_START, VAR_END, 
-              FOR, IN, DO, DONE, INCLUDE };
+              FOR, IN, DO, DONE, INCLUDE, CONTENT, END };
 
 struct appconf {
     struct ut_str shell;
@@ -68,11 +287,145 @@ struct appconf {
     struct ut_str static_dir;
 };
 
+/* 
+ * A compiled template is an array of nodes closed by an END node. FOR
+ * links to its DONE, an IDENT followed by '.' links to the member name.
+ */
 struct tree_node {
+    unsigned char token;
+    int slot;
+    struct tree_node *link;
+    /* BLOCK text points into the page code and is not terminated */
+    char *buffer;
+    size_t len;
+    struct page *page;
+};
+
+/* parts of a build timed by --stats and --trace */
+enum PHASES { PH_STATIC, PH_DEPS, PH_READ, PH_MARKDOWN, PH_COMPILE, 
+              PH_RENDER, PH_SHELL, PH_DIRS, PH_WRITE, PH_COUNT };
+
+/* a phase the current thread is in, see phase_begin() */
+struct phase_frame {
+    int phase;
+    const char *arg;
+    uint64_t start;
+    /* since when time counts for this phase, nested phases pause it */
+    uint64_t resume;
+};
+
+/* one of the slowest renders */
+struct slow_page {
+    char *path;
+    uint64_t ns;
+};
+
+enum OPS { OP_LIT, OP_ROOT, OP_THIS, OP_THIS_MEMBER, OP_VAR, OP_VAR_MEMBER,
+           OP_CONTENT, OP_INCLUDE, OP_SH, OP_LOOP_SH, OP_LOOP_DIR, OP_NEXT,
+           OP_HALT };
+
+struct insn {
+    unsigned char op;
+    /* variable or loop variable */
+    int slot;
+    int member;
+    /* pc after a consumed member, or after the loop when it is empty */
+    int jump;
+    unsigned int len;
+    union {
+        const char *s;
+        struct page *page;
+    } u;
+};
+
+/* bytecode of a template, compiled from its nodes */
+struct prog {
+    struct insn *code;
+    int n;
+    int max_loops;
+};
+
+/* a running loop of the vm */
+struct vm_loop {
+    int body;
+    int slot;
+    struct sh_result *r;
+    size_t pos;
+    struct dir_list *dl;
+    int idx;
+};
+
+/* template parser state while a page is compiled */
+struct tree_ctx {
     int token;
-    int scope;
-    struct ut_str buffer;
-    struct tree_node *next;
+    /* the last token, a slice of the page code */
+    const char *tok;
+    size_t tok_len;
+    /* scratch for variable names */
+    struct ut_str name;
+    /* nodes as parsed, copied into the page arena once complete */
+    struct tree_node *nodes;
+    int n;
+    int cap;
+    struct arena *arena;
+    /* first syntax error, the rest of the page is skipped */
+    const char *err;
+};
+
+struct keyword {
+    const char *word;
+    size_t len;
+    int token;
+};
+
+struct hash_slot {
+    char *key;
+    uint64_t hash;
+    void *value;
+};
+
+struct hash_map {
+    struct hash_slot *slots;
+    size_t cap;
+    size_t size;
+};
+
+/* what an output file was built from */
+struct dep_entry {
+    char *out;
+    struct dep_stamp *deps;
+    int ndeps;
+};
+
+/* a page rendered by --serve */
+struct served {
+    char *body;
+    size_t len;
+    struct dep_entry *deps;
+};
+
+struct copy_job {
+    struct work_pool *wp;
+    char *src;
+    char *dest;
+    bool top;
+};
+
+/* output of a shell command, shared by every block running it */
+struct sh_result {
+    char *out;
+    size_t len;
+    bool done;
+};
+
+/* a long running conf.shell that commands are piped to */
+struct coproc {
+    pid_t pid;
+    int in;
+    int out;
+    bool busy;
+    unsigned long seq;
+    struct coproc *next;
 };
 
 struct page_stack {
@@ -83,74 +436,332 @@ struct page_stack {
 
 struct lacy_env {
     int depth;
+    struct arena *arena;
     struct page_stack *p_stack;
-    struct page_attr *sym_tbl;
+    /* variable values indexed by symbol slot */
+    struct env_var *vars;
+    int nvars;
+
+    /* set of source paths this render read */
+    struct hash_map deps;
+    /* the first page a member named that could not be read */
+    struct ut_str *err;
+};
+
+struct pool_job {
+    void (*fn)(void *);
+    void *arg;
+    struct pool_job *next;
+};
+
+struct work_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t has_work;
+    pthread_cond_t idle;
+    struct pool_job *head;
+    struct pool_job *tail;
+    pthread_t *threads;
+    int nthreads;
+    int active;
+    bool stop;
 };
 
 /* function declarations */
 static int build_depth(char *file_path);
 static int copy_dir(char *src, char *dest);
+static void copy_submit(struct work_pool *wp, char *src, char *dest, 
+                        void (*fn)(void *), bool top);
+static bool copy_dest_dir(char *dest);
+static int link_file(char *src, char *dest);
+static bool symlink_dir(char *src, char *dest);
+static void copy_dir_job(void *arg);
+static void copy_file_job(void *arg);
 static int copy_file(char *src, char *dest);
+static bool copy_fd(int sfd, int dfd, off_t size);
 static bool file_exists(char *s);
-static bool flook_ahead(FILE *f, char *s, int n);
-static bool slook_ahead(char *f, char *s, int n);
+static struct dir_list * dir_lookup(const char *path);
+static void dir_read(const char *path, struct dir_list *dl);
+static int dir_entry_cmp(const void *a, const void *b);
+static void dir_list_free(void *v);
 static int iswhitespace(char c);
 static int isnewline(char c);
 static void fatal(const char *s, ...);
 static void warn(const char *fmt, ...);
 static void setup();
 static void render(struct page *p);
+static struct dep_entry * render_mem(struct page *p, struct ut_str *out, 
+                                     const char *outfile, 
+                                     struct ut_str *err);
 static void env_build(struct page *p, struct lacy_env *env);
 static void env_free(struct lacy_env *env);
-static void env_set(struct lacy_env *env, char *ident, char *value);
-static void tree_push(int tok, char *buffer);
-static void build_tree(struct lacy_env *env);
-static void do_build_tree(char *s, struct lacy_env *env);
-static void parse_header(FILE *f, struct page *p);
-static struct page * parse_page(FILE *f, char *file_path);
+static void env_set(struct lacy_env *env, int slot, char *value);
+static void env_set_entry(struct lacy_env *env, int slot, 
+                          struct dir_entry *de);
+static struct env_var * env_slot(struct lacy_env *env, int slot);
+static struct tree_node * tree_push(struct tree_ctx *ctx, int tok, 
+                                    const char *s, size_t len);
+static int keyword_lookup(const char *s, size_t len);
+static struct tree_node * tree_link(struct tree_ctx *ctx);
+static struct tree_node * page_tree(struct page *p);
+static struct tree_node * page_parse(struct page *p, const char **err);
+static bool page_check(struct page *p, struct ut_str *err);
+static bool page_check_tree(struct page *p, struct hash_map *seen, 
+                            struct ut_str *err);
+static void do_build_tree(char *s, struct tree_ctx *ctx);
+static void parse_header(struct page *p, const char *s, const char *end);
+static struct page * parse_page(char *file_path, char *src, size_t len);
+static void page_src_free(struct page *p);
 static void parse_filepath(const char *file_path, struct page *p);
 static void page_attr_free(struct page *p);
 static void page_add(struct page *np);
+static void page_path_key(const char *file_path, struct ut_str *key);
 static struct page * page_find(char *file_path);
+static struct page * page_load(char *file_path);
 static struct page * page_slurp(char *file_path);
-static struct page_attr * page_attr_lookup(struct page *e, char *s);
+static struct page_attr * page_attr_lookup(struct page *p, int slot);
+static void page_attr_index(struct page *p, struct page_attr *a);
+static void sym_init();
+static int sym_intern(const char *name);
+static void sym_free();
 static void page_list_init();
 static void page_list_free();
-static void page_free();
-static char *parse_var(char *s, struct page *p, struct lacy_env *env);
-static char *parse_expression(char *s, struct lacy_env *env);
-static char *parse_include(char *s, struct lacy_env *env);
-static char *parse_foreach(char *s, struct lacy_env *env);
-static char *parse_sh_exp(char *s, struct lacy_env *env);
-static void str_resize(struct ut_str *u, long ns);
+static void page_free(struct page *p);
+static char *parse_var(char *s, struct tree_ctx *ctx);
+static char *parse_expression(char *s, struct tree_ctx *ctx);
+static char *parse_include(char *s, struct tree_ctx *ctx);
+static char *parse_foreach(char *s, struct tree_ctx *ctx);
+static char *parse_sh_exp(char *s, struct tree_ctx *ctx);
+static char *parse_fail(char *s, struct tree_ctx *ctx, const char *err);
+static void str_resize(struct ut_str *u, size_t ns);
 static void str_init(struct ut_str *u);
 static void str_append(struct ut_str *u, char c);
-static void str_append_str(struct ut_str *u, char *s);
+static void str_append_str(struct ut_str *u, const char *s);
+static void str_append_mem(struct ut_str *u, const char *s, size_t n);
 static void str_trim(struct ut_str *u);
 static int str_is_empty(struct ut_str *u);
 static void str_clear(struct ut_str *u);
 static void str_free(struct ut_str *u);
-static void write_tree(FILE *out, struct lacy_env *env);
-static void do_write_tree(FILE *out, struct lacy_env *env, struct tree_node *top);
-static struct tree_node * write_include(FILE *out, struct tree_node *t, struct lacy_env *env);
-static struct tree_node * write_var(FILE *out, struct tree_node *t, struct lacy_env *env);
-static void write_sh_block(FILE *out, struct tree_node *t, struct lacy_env *env);
-static struct tree_node * write_for(FILE *out, struct tree_node *t, struct lacy_env *env);
-static struct tree_node * write_member(FILE *out, struct tree_node *t, 
+static void write_tree(struct ut_str *out, struct lacy_env *env);
+static void write_content(struct ut_str *out, struct lacy_env *env);
+static void do_write_tree(struct ut_str *out, struct lacy_env *env, struct tree_node *top);
+static struct tree_node * write_include(struct ut_str *out, struct tree_node *t, struct lacy_env *env);
+static struct tree_node * write_var(struct ut_str *out, struct tree_node *t, struct lacy_env *env);
+static void write_sh_block(struct ut_str *out, struct tree_node *t, struct lacy_env *env);
+static struct tree_node * write_for(struct ut_str *out, struct tree_node *t, struct lacy_env *env);
+static struct tree_node * write_member(struct ut_str *out, struct tree_node *t, 
                                        struct page *p, struct lacy_env *env) ;
-static int next_token(char **s);
-struct page_attr * env_attr_lookup(struct lacy_env *e, char *s);
+static void write_attr(struct ut_str *out, struct page *p, int slot, 
+                       struct lacy_env *env);
+static void write_var_member(struct ut_str *out, struct lacy_env *env, 
+                             int slot, int member);
+static struct prog * page_prog(struct page *p);
+static struct prog * prog_compile(struct arena *a, struct tree_node *t);
+static void vm_run(struct ut_str *out, struct lacy_env *env, struct prog *pr);
+static bool vm_loop_next(struct lacy_env *env, struct vm_loop *l);
+static void run_page(struct ut_str *out, struct lacy_env *env, 
+                     struct page *p, bool layout);
+static native_fn page_native(struct page *p);
+static native_fn native_build(struct prog *pr);
+static void native_gen(struct prog *pr, struct ut_str *src, 
+                       int **syms, int *nsyms, 
+                       struct page ***pages, int *npages);
+static int native_index(int **v, int *n, int x);
+static int native_key(int **v, int *n, int op, int a, int b);
+static void native_quote(struct ut_str *dst, const char *s, size_t n);
+static bool native_compile(const char *c_path, const char *so_path);
+static void native_free();
+static void rt_grow(void *out, const char *s, size_t n);
+static const char * rt_root(void *env);
+static const char * rt_self(void *env);
+static int rt_self_member(void *env, int member, const char **value);
+static const char * rt_var(void *env, int slot);
+static int rt_var_member(void *env, int slot, int member, 
+                         const char **value);
+static void rt_content(void *out, void *env);
+static void rt_include(void *out, void *env, void *page);
+static const char * rt_sh(const char *cmd, size_t *n);
+static const char * rt_value(struct lacy_env *env, struct ut_str *u);
+static void *rt_loop_sh(void *env, int slot, const char *cmd);
+static void *rt_loop_dir(void *env, int slot, const char *path);
+static int rt_loop_next(void *env, void *loop);
+static struct vm_loop * rt_loop(struct lacy_env *env, int slot);
+static int next_token(char **s, struct tree_ctx *ctx);
+static char * env_attr_lookup(struct lacy_env *env, int slot);
+static struct dir_entry * env_entry_lookup(struct lacy_env *env, int slot);
 static void usage();
 static void version();
-static void write_depth(FILE *out, struct lacy_env *env);
+static void write_depth(struct ut_str *out, struct lacy_env *env);
+static struct sh_result * sh_exec(const char *cmd);
+static void sh_run(const char *cmd, struct ut_str *out);
+static void sh_cache_key(const char *cmd, struct ut_str *key);
+static bool cache_read(const char *kind, const char *key, size_t klen, 
+                       struct ut_str *out);
+static void cache_write(const char *kind, const char *key, size_t klen, 
+                        const char *s, size_t len);
+static void mkd_convert(struct page *p, const char *body, size_t body_len);
+static void mkd_prepass(char **paths, int n);
+static void mkd_prepass_job(void *arg);
+static void sh_result_free(void *v);
+static void sh_prefetch(struct lacy_env *env);
+static bool sh_prefetch_tree(struct tree_node *t);
+static void sh_prefetch_cmd(char *cmd);
+static void sh_prefetch_job(void *arg);
+static void coproc_run(const char *cmd, struct ut_str *out);
+static struct coproc * coproc_get();
+static void coproc_put(struct coproc *cp);
+static bool coproc_spawn(struct coproc *cp);
+static void coproc_kill(struct coproc *cp);
+static void coproc_free_all();
+static bool cache_path(const char *kind, uint64_t hash, struct ut_str *path);
+static bool write_file_atomic(const char *path, const char *s, size_t len);
+static bool file_same(const char *path, const char *s, size_t len);
+static void pool_init(struct work_pool *wp, int nthreads);
+static void pool_submit(struct work_pool *wp, void (*fn)(void *), void *arg);
+static void pool_wait(struct work_pool *wp);
+static void pool_free(struct work_pool *wp);
+static void *pool_worker(void *arg);
+static void render_job(void *arg);
+static void render_pages(char **paths, int n, void (*fn)(void *));
+static void watch(char **paths, int n);
+static void watch_dir(const char *dir);
+static void watch_tree(const char *dir);
+static void watch_deps(char **paths, int n);
+static bool watch_read(struct hash_map *changed);
+static void watch_cycle(char **paths, int n, struct hash_map *changed, 
+                        bool all);
+static void watch_static(struct hash_map *changed);
+static void watch_render_job(void *arg);
+static void stop_signal(int sig);
+static bool page_reload(struct page *p, struct ut_str *err);
+static void serve(int port);
+static void serve_conn(int fd);
+static bool serve_target(char *target, struct ut_str *rel);
+static void serve_page(int fd, const char *src, bool head);
+static bool serve_static(int fd, const char *rel, bool head);
+static void serve_reply(int fd, const char *status, const char *type, 
+                        size_t len, const char *extra);
+static const char * serve_type(const char *path);
+static void served_free(void *v);
+static bool write_all(int fd, const char *s, size_t n);
+static struct dep_entry * dep_entry_lookup(const char *src_path);
+static uint64_t stats_now();
+static void phase_begin(int phase, const char *arg);
+static uint64_t phase_end();
+static void stats_page(const char *path, uint64_t ns);
+static void stats_print();
+static void trace_open(const char *path);
+static void trace_event(int phase, const char *arg, uint64_t start, 
+                        uint64_t end);
+static void trace_close();
+static void json_quote(FILE *f, const char *s);
+static void path_dir(const char *path, struct ut_str *dir);
+static struct arena * render_arena();
+static void arena_init(struct arena *a, size_t block_size);
+static void *arena_alloc(struct arena *a, size_t n);
+static char *arena_strdup(struct arena *a, const char *s);
+static char *arena_strndup(struct arena *a, const char *s, size_t n);
+static void arena_reset(struct arena *a);
+static void arena_free(struct arena *a);
+static void arena_adopt(struct arena *a, struct arena *from);
+static uint64_t hash_str(const char *s);
+static uint64_t hash_mem(const char *s, size_t n);
+static void map_init(struct hash_map *m);
+static void *map_get(struct hash_map *m, const char *key);
+static void map_put(struct hash_map *m, const char *key, void *value);
+static void map_grow(struct hash_map *m);
+static void map_free(struct hash_map *m, void (*free_value)(void *));
+static void env_add_dep(struct lacy_env *env, const char *path);
+static void dep_stamp_read(const char *path, struct dep_stamp *ds);
+static bool dep_stamp_changed(struct dep_stamp *ds);
+static bool deps_fresh(const char *src_path);
+static struct dep_entry * dep_entry_new(const char *out, 
+                                        struct lacy_env *env);
+static void deps_record(const char *src_path, struct dep_entry *e);
+static void deps_load();
+static void deps_save();
+static void dep_entry_free(void *v);
 
 /* variables */
 static struct appconf conf;
-static int token;
-static struct ut_str curtok;
-static struct tree_node *tree_top;
+static pthread_rwlock_t page_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct hash_map page_map;
+static pthread_mutex_t sym_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hash_map sym_map;
+static char **sym_names;
+static int sym_count;
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool native_mode = false;
+static pthread_mutex_t native_lock = PTHREAD_MUTEX_INITIALIZER;
+static void **native_handles;
+static int native_nhandles;
+static const struct native_rt native_rt = {
+    rt_grow, rt_root, rt_self, rt_self_member, rt_var, rt_var_member,
+    rt_content, rt_include, rt_sh, rt_loop_sh, rt_loop_dir, rt_loop_next
+};
 static bool quiet_flag = 0;
 static int verbosity = 1;
+static int jobs = 1;
+static int static_mode = STATIC_COPY;
+static int engine = ENGINE_VM;
+static bool sh_cache = false;
+static struct hash_map sh_memo;
+static pthread_mutex_t sh_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sh_done = PTHREAD_COND_INITIALIZER;
+static bool sh_coproc = false;
+static int sh_jobs = SH_JOBS;
+static struct work_pool sh_pool;
+static int coproc_max = 1;
+static int coproc_count = 0;
+static struct coproc *coproc_list;
+static pthread_mutex_t coproc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t coproc_free = PTHREAD_COND_INITIALIZER;
+/* top level output directories that rendered pages are written to */
+static struct hash_map page_dirs;
+static __thread struct arena *thread_arena;
+static bool always_make = false;
+static struct hash_map deps_prev;
+static struct hash_map deps_next;
+static pthread_mutex_t deps_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hash_map dir_cache;
+static mode_t file_mode = 0644;
+static int count_rewritten = 0;
+static int count_unchanged = 0;
+static pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool watch_mode = false;
+static int watch_fd = -1;
+/* watched directory by name, and by watch descriptor */
+static struct hash_map watch_dirs;
+static char **watch_names;
+static int watch_nnames;
+static volatile sig_atomic_t stop_flag = 0;
+static int serve_port = 0;
+/* rendered pages by source path */
+static struct hash_map serve_cache;
+static bool stats_mode = false;
+static int stats_slowest = STATS_SLOWEST;
+/* whether phases are timed at all, for --stats or --trace */
+static bool timing = false;
+static uint64_t stats_start;
+/* time spent in each phase outside of nested ones, in ns */
+static uint64_t phase_ns[PH_COUNT];
+static long phase_count[PH_COUNT];
+static const char *phase_names[PH_COUNT] = {
+    "static", "deps", "read", "markdown", "compile", 
+    "render", "shell", "dirs", "write"
+};
+static __thread struct phase_frame phase_stack[PHASE_DEPTH];
+static __thread int phase_depth;
+static long stats_find_hits = 0;
+static long stats_find_misses = 0;
+static long stats_shells = 0;
+static long long stats_bytes = 0;
+/* the slowest renders, slowest first */
+static struct slow_page *slow_pages;
+static int slow_npages = 0;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file;
+static bool trace_first = true;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 void
@@ -164,6 +775,15 @@ setup()
     str_append_str(&conf.output_dir, "_output");
     str_append_str(&conf.static_dir, "_static");
 
+    /* what fopen would have given new files */
+    file_mode = umask(0);
+    umask(file_mode);
+    file_mode = 0666 & ~file_mode;
+
+    /* pages are rendered on request and static files sent from _static */
+    if (serve_port > 0)
+        return;
+
     if (0 != mkdir(conf.output_dir.s, 0777)) {
         if (EEXIST != errno) {
             fatal("Unable to mkdir %s\n", conf.output_dir.s);
@@ -171,10 +791,12 @@ setup()
     }
 
     if (file_exists(conf.output_dir.s)) {
+        phase_begin(PH_STATIC, NULL);
         if (0 != copy_dir(conf.static_dir.s, conf.output_dir.s)) {
             warn("Unable to copy %s to %s\n", 
                     conf.static_dir.s, conf.output_dir.s);
         }
+        phase_end();
     }
 }
 
@@ -184,8 +806,8 @@ env_build(struct page *p, struct lacy_env *env)
     env->p_stack->size++; 
     if (NULL == p || NULL == p->inherits 
      || MAX_INHERIT <= env->p_stack->size) {
-        env->p_stack->stack = 
-            calloc(env->p_stack->size, sizeof (struct page *));
+        env->p_stack->stack = arena_alloc(env->arena, 
+                env->p_stack->size * sizeof (struct page *));
     }
     else if (NULL != p->inherits) {
         env_build(p->inherits, env);
@@ -198,159 +820,341 @@ env_build(struct page *p, struct lacy_env *env)
 
     struct page_attr *t = p->attr_top;
     while (t != NULL) {
-        env_set(env, t->name.s, t->value.s);
+        env_set(env, t->slot, t->value);
         t = t->next;
     }
 }
 
+/* everything else is owned by the render arena */
 void 
 env_free(struct lacy_env *env)
 {
-    struct page_attr *tmp;
-    struct page_attr *t = env->sym_tbl;
-
-    while (t != NULL) {
-        tmp = t->next;
-        free(t);
-        t = tmp;
-    }
-
-    free(env->p_stack->stack);
+    env->vars = NULL;
+    env->nvars = 0;
+    env->p_stack->stack = NULL;
 }
 
 void 
-env_set(struct lacy_env *env, char *ident, char *value)
+env_set(struct lacy_env *env, int slot, char *value)
 {
-    struct page_attr *e = env_attr_lookup(env, ident);
-    if (NULL == e) {
-
-        e = malloc(sizeof(struct page_attr));
-        e->next = NULL;
-        str_init(&(e->name));
-        str_init(&(e->value));
+    env_slot(env, slot)->value = arena_strdup(env->arena, value);
+}
 
-        str_append_str(&(e->name), ident);
-        str_append_str(&(e->value), value);
+/* loop variable bound to a directory entry, the name is not copied */
+void
+env_set_entry(struct lacy_env *env, int slot, struct dir_entry *de)
+{
+    struct env_var *v = env_slot(env, slot);
+    v->value = de->name;
+    v->entry = de;
+}
 
-        if (env->sym_tbl == NULL) {
-            env->sym_tbl = e;
-        }
-        else {
-            struct page_attr *t = env->sym_tbl;
-            while (t->next != NULL) 
-                t = t->next;
-            
-            t->next = e;
-        }
-    }
-    else {
-        str_clear(&(e->value));
-        str_append_str(&(e->value), value);
+struct env_var *
+env_slot(struct lacy_env *env, int slot)
+{
+    if (slot >= env->nvars) {
+        int n = env->nvars;
+        struct env_var *vars = env->vars;
+
+        env->nvars = slot < 2 * n ? 2 * n : slot + 1;
+        env->vars = arena_alloc(env->arena, 
+                env->nvars * sizeof(struct env_var));
+        if (n > 0)
+            memcpy(env->vars, vars, n * sizeof(struct env_var));
+        memset(env->vars + n, 0, (env->nvars - n) * sizeof(struct env_var));
     }
+    env->vars[slot].entry = NULL;
+    return &env->vars[slot];
 }
 
+/* caller holds page_lock for writing */
 void
 page_add(struct page *np)
 {
-    struct page *p;
-    if (NULL == page_list) {
+    struct ut_str key;
+
+    np->next = NULL;
+    np->prev = page_tail;
+    if (NULL == page_list) 
         page_list = np;
-        np->next = NULL;
-        np->prev = NULL;
-        return;
-    }
-    p = page_list;
-    while (NULL != p->next) 
-        p = p->next;
+    else
+        page_tail->next = np;
+    page_tail = np;
+
+    /* a page is known by its source and by its output name */
+    str_init(&key);
+    page_path_key(np->src_path, &key);
+    map_put(&page_map, key.s, np);
+    str_clear(&key);
+    page_path_key(np->file_path, &key);
+    if (NULL == map_get(&page_map, key.s))
+        map_put(&page_map, key.s, np);
+    str_free(&key);
+}
 
-    p->next = np;
-    np->prev = p;
+/* "./a//b/./c" and "a/b/c" name the same page */
+void
+page_path_key(const char *file_path, struct ut_str *key)
+{
+    const char *s = file_path;
+    while (*s != '\0') {
+        if ('.' == s[0] && '/' == s[1] && (s == file_path || '/' == s[-1])) {
+            s += 2;
+        }
+        else if ('/' == s[0] && (s == file_path || '/' == s[-1])
+              && key->len > 0) {
+            s++;
+        }
+        else {
+            str_append(key, *s++);
+        }
+    }
 }
 
 struct page *
 page_find(char *file_path)
 {
-    struct page *p = page_list;
-    while (NULL != p) {
-        if (0 == strcmp(p->file_path, file_path))
-            return p;
+    struct page *p = page_load(file_path);
+    if (NULL == p)
+        fatal("Unable to open: %s\n", file_path);
+    return p;
+}
+
+/* page_find() that returns NULL when the source can not be read */
+struct page *
+page_load(char *file_path)
+{
+    struct page *p, *np;
+    struct ut_str key;
+
+    str_init(&key);
+    page_path_key(file_path, &key);
+
+    pthread_rwlock_rdlock(&page_lock);
+    p = map_get(&page_map, key.s);
+    pthread_rwlock_unlock(&page_lock);
+    if (NULL != p) {
+        __atomic_add_fetch(&stats_find_hits, 1, __ATOMIC_RELAXED);
+        str_free(&key);
+        return p;
+    }
+    __atomic_add_fetch(&stats_find_misses, 1, __ATOMIC_RELAXED);
+
+    /* parse outside of the lock, page_slurp may recurse into page_find */
+    if (NULL == (np = page_slurp(file_path))) {
+        str_free(&key);
+        return NULL;
+    }
 
-        p = p->next;
+    pthread_rwlock_wrlock(&page_lock);
+    if (NULL == (p = map_get(&page_map, key.s))) {
+        page_add(np);
+        p = np;
+        np = NULL;
     }
-    p = page_slurp(file_path);
-    page_add(p);
+    pthread_rwlock_unlock(&page_lock);
+    str_free(&key);
+
+    /* another thread loaded the same page first */
+    page_free(np);
 
     return p;
 }
 
-struct page * 
+/* 
+ * Sources are mapped when the kernel zero fills the tail of the last
+ * page, which leaves the contents NUL terminated for the lexer. Files
+ * of exactly a multiple of the page size, and anything that can not be
+ * mapped, are read with a single read(). So are all sources with --watch
+ * and --serve, a page kept over a broken edit must not see the new text.
+ * Returns NULL when the file can not be read.
+ */
+struct page *
 page_slurp(char *file_path)
 {
+    int fd;
+    ssize_t n;
+    size_t len = 0;
+    bool mapped = false;
+    char *src = NULL;
+    struct stat st;
     struct page *p = NULL;
 
-    FILE *f = fopen(file_path, "r");
+    phase_begin(PH_READ, file_path);
+    if (-1 == (fd = open(file_path, O_RDONLY))) {
+        phase_end();
+        return NULL;
+    }
+    if (0 != fstat(fd, &st)) {
+        close(fd);
+        phase_end();
+        return NULL;
+    }
 
-    if (NULL == f) {
-        fatal("Unable to open: %s\n", file_path);
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && !watch_mode 
+     && 0 == serve_port && 0 != st.st_size % sysconf(_SC_PAGESIZE)) {
+        src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (MAP_FAILED == src) {
+            src = NULL;
+        }
+        else {
+            len = st.st_size;
+            mapped = true;
+            madvise(src, len, MADV_SEQUENTIAL);
+        }
+    }
+    if (NULL == src) {
+        size_t size = S_ISREG(st.st_mode) ? st.st_size + 1 : BUFSIZ;
+        src = malloc(size);
+        while ((n = read(fd, src + len, size - len - 1)) > 0) {
+            len += n;
+            if (len + 1 == size) {
+                size *= 2;
+                src = realloc(src, size);
+            }
+        }
+        if (n < 0) {
+            free(src);
+            close(fd);
+            phase_end();
+            return NULL;
+        }
+        src[len] = '\0';
+    }
+
+    if (0 != close(fd)) {
+        fatal("Unabled to close: %s\n", file_path);
     }
 
-    p = parse_page(f, file_path); 
+    p = parse_page(file_path, src, len); 
+    p->src_path = strdup(file_path);
     p->next = NULL;
     p->prev = NULL;
 
-    if (0 != fclose(f)) {
-        fatal("Unabled to close: %s\n", file_path);
-    }
+    p->src_mapped = mapped;
+    p->stamp.path = p->src_path;
+    p->stamp.mtime_sec = st.st_mtim.tv_sec;
+    p->stamp.mtime_nsec = st.st_mtim.tv_nsec;
+    p->stamp.size = st.st_size;
+    p->src = src;
+    p->src_len = len;
+    if (p->code < src || p->code > src + len) 
+        page_src_free(p);
+    phase_end();
+
     return p;
 }
 
-struct page *
-parse_page(FILE *f, char *file_path)
+void
+page_src_free(struct page *p)
 {
-    char c;
-    int parsed_header = 0;
-    struct ut_str buffer;
+    if (NULL == p->src)
+        return;
 
-    /* markdown vars */
+    if (p->src_mapped)
+        munmap(p->src, p->src_len);
+    else
+        free(p->src);
+    p->src = NULL;
+}
 
+/* src must be NUL terminated at len */
+struct page *
+parse_page(char *file_path, char *src, size_t len)
+{
+    char *hdr, *hdr_end;
+    char *body = src;
+    size_t body_len = len;
     struct page *p = malloc(sizeof(struct page));
 
     parse_filepath(file_path, p);
 
     p->inherits = NULL;
     p->attr_top = NULL;
-    str_init(&buffer);
-
-    while ((c = fgetc(f)) != EOF) {
-        if (!parsed_header && '-' == c && flook_ahead(f, "--", 2)) {
-            parse_header(f, p);
-            parsed_header = 1;
-        }
-        else {
-            str_append(&buffer, c);
+    p->attr_slots = NULL;
+    p->nattr_slots = 0;
+    p->tree = NULL;
+    p->prog = NULL;
+    p->native = NULL;
+    p->native_tried = false;
+    p->err = NULL;
+    p->src = NULL;
+    p->code = NULL;
+    arena_init(&p->arena, ARENA_PAGE);
+
+    /* the header runs from the first "---" to the next one */
+    if (NULL != (hdr = memmem(src, len, "---", 3))) {
+        hdr += 3;
+        hdr_end = memmem(hdr, src + len - hdr, "---", 3);
+        if (NULL == hdr_end) 
+            hdr_end = src + len;
+
+        parse_header(p, hdr, hdr_end);
+
+        body = hdr_end + (hdr_end < src + len ? 3 : 0);
+        body_len = src + len - body;
+        if (hdr - 3 > src) {
+            /* text before the header has to be joined with the rest */
+            size_t pre = hdr - 3 - src;
+            char *code = malloc(pre + body_len + 1);
+            memcpy(code, src, pre);
+            memcpy(code + pre, body, body_len + 1);
+            body = code;
+            body_len += pre;
         }
-    } 
-    while (c != EOF);
-
-    p->code = malloc(sizeof(char) * buffer.size + 1);
-    memset(p->code, '\0', buffer.size + 1);
+    }
 
     if (MARKDOWN == p->page_type) {
-        Document *doc = mkd_string(buffer.s, buffer.size + 1, 0);
-        if (NULL != doc && mkd_compile(doc, 0) ) {
-            char *html = NULL;
-            int szdoc = mkd_document(doc, &html);
-            strncpy(p->code, html, szdoc);
-            mkd_cleanup(doc);
+        mkd_convert(p, body, body_len);
+        if (body < src || body > src + len)
+            free(body);
+    } else {
+        p->code = body;
+        p->code_len = body_len;
+    }
+
+    return p;
+}
 
+/* 
+ * HTML of a markdown body into p->code. Conversions are cached by the
+ * discount version, flags and the body itself.
+ */
+void
+mkd_convert(struct page *p, const char *body, size_t body_len)
+{
+    char head[64];
+    struct ut_str key, html;
+    Document *doc;
+
+    phase_begin(PH_MARKDOWN, p->file_path);
+    str_init(&key);
+    str_init(&html);
+    snprintf(head, sizeof(head), "discount %s %d\n", 
+            markdown_version, MKD_FLAGS);
+    str_append_str(&key, head);
+    str_append_mem(&key, body, body_len);
+
+    if (!cache_read("mkd", key.s, key.len, &html)) {
+        doc = mkd_string(body, body_len, MKD_FLAGS);
+        if (NULL != doc && mkd_compile(doc, MKD_FLAGS)) {
+            char *s = NULL;
+            int szdoc = mkd_document(doc, &s);
+            if (szdoc > 0)
+                str_append_mem(&html, s, szdoc);
         }
-    } else {
-        strncpy(p->code, buffer.s, buffer.size);
+        if (NULL != doc)
+            mkd_cleanup(doc);
+        cache_write("mkd", key.s, key.len, html.s, html.len);
     }
-    str_free(&buffer);
 
+    p->code = malloc(html.len + 1);
+    memcpy(p->code, html.s, html.len + 1);
+    p->code_len = html.len;
 
-    return p;
+    str_free(&html);
+    str_free(&key);
+    phase_end();
 }
 
 void 
@@ -362,7 +1166,7 @@ parse_filepath(const char *file_path, struct page *p) {
     if (NULL != (start = strstr(file_path, ".mkd"))) {
         len = len - strlen(start) - 1;
         p->file_path = malloc(sizeof(char) * (len + 6));
-        memset(p->file_path, '\0', len);
+        memset(p->file_path, '\0', len + 6);
         strncpy(p->file_path, file_path, len);
         strncat(p->file_path, ".html", 5);
         p->page_type = MARKDOWN;
@@ -375,7 +1179,7 @@ parse_filepath(const char *file_path, struct page *p) {
 }
 
 void
-parse_header(FILE *f, struct page *p) 
+parse_header(struct page *p, const char *s, const char *end) 
 {
     char c;
     struct ut_str val, var;
@@ -384,13 +1188,8 @@ parse_header(FILE *f, struct page *p)
     str_init(&val);
     str_init(&var);
 
-    do {
-        c = fgetc(f);
-        if ('-' == c && flook_ahead(f, "--", 2)) {
-            str_free(&var);
-            str_free(&val);
-            return;
-        }
+    for (; s < end; ++s) {
+        c = *s;
         switch (c) {
         case '\n':
         case '\r':
@@ -398,20 +1197,23 @@ parse_header(FILE *f, struct page *p)
                 str_trim(&var);
                 str_trim(&val);
                 if (0 == strcmp("inherits", var.s)) {
-                    p->inherits = page_find(val.s);
+                    p->inherits = page_load(val.s);
+                    if (NULL == p->inherits && NULL == p->err) {
+                        str_clear(&var);
+                        str_append_str(&var, "inherited page not found: ");
+                        str_append_str(&var, val.s);
+                        p->err = arena_strdup(&p->arena, var.s);
+                    }
                 }
                 else {
-                    struct page_attr a;
-                    struct page_attr *ap = malloc(sizeof(struct page_attr));
-
-                    memcpy(ap, &a, sizeof(struct page_attr));
+                    struct page_attr *ap = 
+                        arena_alloc(&p->arena, sizeof(struct page_attr));
 
                     ap->next = NULL;
-                    str_init(&ap->name);
-                    str_init(&ap->value);
-
-                    str_append_str(&ap->name, var.s);
-                    str_append_str(&ap->value, val.s);
+                    ap->name = arena_strdup(&p->arena, var.s);
+                    ap->value = arena_strdup(&p->arena, val.s);
+                    ap->slot = sym_intern(var.s);
+                    page_attr_index(p, ap);
 
                     if (NULL == p->attr_top) {
                         p->attr_top = ap;
@@ -441,7 +1243,6 @@ parse_header(FILE *f, struct page *p)
             }
         }
     }
-    while (c != EOF);
 
     str_free(&var);
     str_free(&val);
@@ -462,14 +1263,28 @@ page_free(struct page* p)
 
     if (NULL != p->file_path)
         free(p->file_path);
-    if (NULL != p->code)
+    if (NULL != p->src_path)
+        free(p->src_path);
+    if (NULL != p->code 
+     && (NULL == p->src || p->code < p->src || p->code > p->src + p->src_len))
         free(p->code);
+    page_src_free(p);
+    p->tree = NULL;
+    p->prog = NULL;
+    p->native = NULL;
+    p->native_tried = false;
+    arena_free(&p->arena);
 
     free(p);
 }
 
 void
-page_list_init() { }
+page_list_init() 
+{ 
+    page_list = NULL;
+    page_tail = NULL;
+    map_init(&page_map);
+}
 
 void
 page_list_free()
@@ -482,120 +1297,211 @@ page_list_free()
         p = tmp;
     }
     page_list = NULL;
+    page_tail = NULL;
+    map_free(&page_map, NULL);
 }
 
 void
 page_attr_free(struct page *p)
 {
-    struct page_attr *tmp;
-    struct page_attr *t = p->attr_top;
-
-    while (t != NULL) {
-        tmp = t->next;
-        str_free(&t->name);
-        str_free(&t->value);
-        free(t);
-        t = tmp;
-    }
+    /* the attributes themselves live in the page arena */
+    free(p->attr_slots);
+    p->attr_slots = NULL;
+    p->nattr_slots = 0;
 }
 
 struct page_attr * 
-page_attr_lookup(struct page *e, char *s)
+page_attr_lookup(struct page *p, int slot)
 {
-    struct page_attr *t = e->attr_top;
-    while (t != NULL) {
-        if (0 == strcmp(t->name.s, s))
-            return t;
+    if (0 <= slot && slot < p->nattr_slots) 
+        return p->attr_slots[slot];
 
-        t = t->next;
-    }
     return NULL;
 }
 
-void 
-tree_push(int tok, char *buffer)
+/* the first attribute of a name wins, as it did for the list walk */
+void
+page_attr_index(struct page *p, struct page_attr *a)
 {
-    struct tree_node *t = malloc(sizeof(struct tree_node));
-    t->next = NULL;
-    t->token = tok;
-    t->scope = 0;
-    if (NULL != buffer) {
-        str_init(&t->buffer);
-        str_append_str(&t->buffer, buffer); 
+    if (a->slot >= p->nattr_slots) {
+        int n = p->nattr_slots;
+        p->nattr_slots = a->slot + 1;
+        p->attr_slots = realloc(p->attr_slots, 
+                p->nattr_slots * sizeof(struct page_attr *));
+        memset(p->attr_slots + n, 0, 
+                (p->nattr_slots - n) * sizeof(struct page_attr *));
     }
+    if (NULL == p->attr_slots[a->slot]) 
+        p->attr_slots[a->slot] = a;
+}
+
+void
+sym_init()
+{
+    map_init(&sym_map);
+    sym_names = NULL;
+    sym_count = 0;
+
+    sym_intern("root");
+    sym_intern("this");
+    sym_intern("content");
+    sym_intern("size");
+    sym_intern("mtime");
+}
 
-    if (NULL == tree_top) {
-        tree_top = t;
+/* slot of name, adding it to the symbol table when new */
+int
+sym_intern(const char *name)
+{
+    int slot;
+
+    pthread_mutex_lock(&sym_lock);
+    slot = (int)(intptr_t)map_get(&sym_map, name) - 1;
+    if (slot < 0) {
+        slot = sym_count++;
+        sym_names = realloc(sym_names, sym_count * sizeof(char *));
+        sym_names[slot] = strdup(name);
+        map_put(&sym_map, name, (void *)(intptr_t)(slot + 1));
     }
-    else {
-        struct tree_node *s = tree_top;
-        while (s->next != NULL)
-            s = s->next;
+    pthread_mutex_unlock(&sym_lock);
+
+    return slot;
+}
+
+void
+sym_free()
+{
+    int i;
+    for (i = 0; i < sym_count; ++i) 
+        free(sym_names[i]);
+    free(sym_names);
+    sym_names = NULL;
+    sym_count = 0;
+    map_free(&sym_map, NULL);
+}
+
+struct tree_node *
+tree_push(struct tree_ctx *ctx, int tok, const char *s, size_t len)
+{
+    struct tree_node *t;
+
+    if (ctx->n == ctx->cap) {
+        ctx->cap = ctx->cap ? 2 * ctx->cap : 64;
+        ctx->nodes = realloc(ctx->nodes, 
+                ctx->cap * sizeof(struct tree_node));
+    }
+    t = &ctx->nodes[ctx->n++];
+    t->token = tok;
+    t->slot = -1;
+    t->link = NULL;
+    t->page = NULL;
+    t->buffer = NULL;
+    t->len = len;
+    if (BLOCK == tok) 
+        t->buffer = (char *)s;
+    else if (NULL != s) 
+        t->buffer = arena_strndup(ctx->arena, s, len);
+    if (IDENT == tok)
+        t->slot = sym_intern(t->buffer);
 
-        s->next = t;
-        t->scope = s->scope;
+    return t;
+}
 
-        if (tok == DO)
-            t->scope = s->scope + 1;
-        else if (tok == DONE) 
-            t->scope = s->scope - 1;
+/* final node array, FOR links are a stack of open loops meanwhile */
+struct tree_node *
+tree_link(struct tree_ctx *ctx)
+{
+    int i, n = ctx->n;
+    struct tree_node *f, *open = NULL;
+    struct tree_node *t = arena_alloc(ctx->arena, 
+            (n + 1) * sizeof(struct tree_node));
+
+    if (n > 0)
+        memcpy(t, ctx->nodes, n * sizeof(struct tree_node));
+    memset(&t[n], 0, sizeof(struct tree_node));
+    t[n].token = END;
+
+    for (i = 0; i < n; ++i) {
+        if (FOR == t[i].token) {
+            t[i].link = open;
+            open = &t[i];
+        }
+        else if (DONE == t[i].token && NULL != open) {
+            f = open;
+            open = f->link;
+            f->link = &t[i];
+        }
+        else if (IDENT == t[i].token && i + 2 < n 
+              && MEMBER == t[i + 1].token) {
+            t[i].link = &t[i + 2];
+        }
     }
+    /* a loop without done runs to the end of the page */
+    while (NULL != open) {
+        f = open;
+        open = f->link;
+        f->link = &t[n - 1];
+    }
+    return t;
 }
 
 int 
-next_token(char **s)
+next_token(char **s, struct tree_ctx *ctx)
 {
     while (iswhitespace(**s)) 
         (*s)++;
 
-    str_clear(&curtok);
-    while (!iswhitespace(**s) && **s != '\0') {
-        str_append(&curtok, **s);
-        (*s)++;
-    }
-    if (strcmp("{%", curtok.s) == 0)
-        token = EXP_START;
-    else if (strcmp("%}", curtok.s) == 0) {
-        token = EXP_END;
+    ctx->tok = *s;
+    *s += strcspn(*s, " \n\r");
+    ctx->tok_len = *s - ctx->tok;
+    ctx->token = keyword_lookup(ctx->tok, ctx->tok_len);
 
-        /* swallow whitespace to not affect output */
+    /* swallow whitespace to not affect output */
+    if (EXP_END == ctx->token) {
         while (isnewline(**s)) 
             (*s)++;
     }
-    else if (strcmp("{$", curtok.s) == 0)
-        token = SH_START;
-    else if (strcmp("$}", curtok.s) == 0) 
-        token = SH_END;
-    else if (strcmp("{{", curtok.s) == 0)
-        token = VAR_START;
-    else if (strcmp("}}", curtok.s) == 0)
-        token = VAR_END;
-    else if (strcmp("for", curtok.s) == 0)
-        token = FOR;
-    else if (strcmp("in", curtok.s) == 0)
-        token = IN;
-    else if (strcmp("do", curtok.s) == 0)
-        token = DO;
-    else if (strcmp("done", curtok.s) == 0)
-        token = DONE;
-    else if (strcmp("include", curtok.s) == 0) 
-        token = INCLUDE;
-    else {
-        token = IDENT;
-    }
-    return token;
+    return ctx->token;
+}
+
+/* 
+ * Keywords by a hash of length, first and last byte, which has no
+ * collisions among them. Anything else is an IDENT.
+ */
+int
+keyword_lookup(const char *s, size_t len)
+{
+    static const struct keyword table[16] = {
+        [1]  = {"}}", 2, VAR_END},
+        [2]  = {"include", 7, INCLUDE},
+        [5]  = {"{$", 2, SH_START},
+        [7]  = {"in", 2, IN},
+        [8]  = {"$}", 2, SH_END},
+        [9]  = {"%}", 2, EXP_END},
+        [10] = {"done", 4, DONE},
+        [11] = {"{{", 2, VAR_START},
+        [12] = {"do", 2, DO},
+        [13] = {"for", 3, FOR},
+        [15] = {"{%", 2, EXP_START},
+    };
+    const struct keyword *k;
+
+    if (0 == len)
+        return IDENT;
+    k = &table[(len + (unsigned char)s[0] 
+                + 10 * (unsigned char)s[len - 1]) & 15];
+    if (NULL != k->word && k->len == len && 0 == memcmp(k->word, s, len))
+        return k->token;
+    return IDENT;
 }
 
 void 
 render(struct page *p)
 {
-    int depth;
-    FILE *out;
-    struct lacy_env env;
-    struct page_stack p_stack;
-    struct ut_str outfile;
-
-    str_init(&curtok);
+    bool changed;
+    uint64_t start = stats_mode ? stats_now() : 0;
+    struct dep_entry *e;
+    struct ut_str outfile, out, err;
 
     if (NULL == p)
         return;
@@ -604,613 +1510,2649 @@ render(struct page *p)
     str_append_str(&outfile, conf.output_dir.s);
     str_append(&outfile, '/');
     str_append_str(&outfile, p->file_path);
+    build_depth(outfile.s);
+
+    str_init(&out);
+    str_init(&err);
+    e = render_mem(p, &out, outfile.s, &err);
+    if (err.len > 0) {
+        /* --watch keeps the last output until the page is there */
+        if (!watch_mode)
+            fatal("%s", err.s);
+        warn("%sNot writing %s\n", err.s, outfile.s);
+        deps_record(p->src_path, e);
+        str_free(&err);
+        str_free(&out);
+        str_free(&outfile);
+        return;
+    }
+    str_free(&err);
+
+    /* 
+     * Leave identical output alone so its mtime stays put. The rename 
+     * also replaces an old output that is linked to a static file.
+     */
+    phase_begin(PH_WRITE, outfile.s);
+    changed = !file_same(outfile.s, out.s, out.len);
+    if (changed && !write_file_atomic(outfile.s, out.s, out.len))
+        fatal("Unable to write: %s\n", outfile.s);
+    if (changed)
+        __atomic_add_fetch(&stats_bytes, out.len, __ATOMIC_RELAXED);
+    phase_end();
+
+    deps_record(p->src_path, e);
+
+    if (changed) {
+        __atomic_add_fetch(&count_rewritten, 1, __ATOMIC_RELAXED);
+        if (verbosity > 0)
+            printf("Rendered %s\n", outfile.s);
+    }
+    else {
+        __atomic_add_fetch(&count_unchanged, 1, __ATOMIC_RELAXED);
+        if (verbosity > 1)
+            printf("Unchanged %s\n", outfile.s);
+    }
+    if (stats_mode)
+        stats_page(p->src_path, stats_now() - start);
+    str_free(&out);
+    str_free(&outfile);
+}
+
+/* 
+ * p into out, returns what it was built from. A page named by a member
+ * that can not be read is added to err and leaves the member empty.
+ */
+struct dep_entry *
+render_mem(struct page *p, struct ut_str *out, const char *outfile, 
+           struct ut_str *err)
+{
+    int i, depth = 0;
+    const char *s;
+    struct lacy_env env;
+    struct page_stack p_stack;
+    struct dep_entry *e;
 
-    /* depth - 1 since we added output dir to path */
-    depth = build_depth(outfile.s) - 1;
-    if (NULL == (out = fopen(outfile.s, "w"))) 
-        fatal("Unable to open: %: ", outfile.s);
+    phase_begin(PH_RENDER, p->src_path);
+    /* one level per directory of the output below the output dir */
+    for (s = p->file_path; '\0' != *s; ++s) {
+        if ('/' == *s)
+            depth++;
+    }
 
     p_stack.size = 0;
     p_stack.pos = 0;
     /* Build Environment */
     env.depth = depth;
     env.p_stack = &p_stack;
-    env.sym_tbl = NULL;
+    env.arena = render_arena();
+    env.vars = NULL;
+    env.nvars = 0;
+    env.err = err;
+    map_init(&env.deps);
 
     env_build(p, &env);
     /* set stack back to top */
     p_stack.pos = 0;
 
+    for (i = 0; i < p_stack.size; ++i) 
+        env_add_dep(&env, p_stack.stack[i]->src_path);
+
+    sh_prefetch(&env);
+
     /* do it already */
-    build_tree(&env);
     write_tree(out, &env);
 
+    e = dep_entry_new(outfile, &env);
+
     env_free(&env);
-    fclose(out);
+    map_free(&env.deps, NULL);
+    arena_reset(env.arena);
+    phase_end();
 
-    str_free(&curtok);
+    return e;
+}
 
-    if (verbosity > 0) {
-        printf("Rendered %s\n", outfile.s);
-    }
-    str_free(&outfile);
+/* compiled template of p, built once and shared by all renders */
+struct tree_node *
+page_tree(struct page *p)
+{
+    const char *err;
+    struct tree_node *t = page_parse(p, &err);
+    if (NULL == t)
+        fatal("%s: %s\n", p->src_path, err);
+    return t;
 }
 
-void 
-build_tree(struct lacy_env *env)
+/* page_tree() that leaves p without a tree on a syntax error */
+struct tree_node *
+page_parse(struct page *p, const char **err)
 {
-    struct page *p = env_get_page(env);
-    char *s = p->code;
-    do_build_tree(s, env);
+    struct tree_ctx ctx;
+    struct arena a;
+    struct tree_node *t = __atomic_load_n(&p->tree, __ATOMIC_ACQUIRE);
+    if (NULL != t)
+        return t;
+    if (NULL != p->err) {
+        *err = p->err;
+        return NULL;
+    }
+
+    /* 
+     * Includes are loaded while parsing, which may run discount, so the
+     * tree is built into an arena of its own and only handed to p under
+     * the lock. Two threads may both build it, the first one is kept.
+     */
+    phase_begin(PH_COMPILE, p->src_path);
+    arena_init(&a, ARENA_PAGE);
+    ctx.nodes = NULL;
+    ctx.n = 0;
+    ctx.cap = 0;
+    ctx.arena = &a;
+    ctx.err = NULL;
+    str_init(&ctx.name);
+    do_build_tree(p->code, &ctx);
+    str_free(&ctx.name);
+    if (NULL == ctx.err)
+        t = tree_link(&ctx);
+    free(ctx.nodes);
+
+    pthread_mutex_lock(&tree_lock);
+    if (NULL == p->tree) {
+        /* the error message may live in the arena as well */
+        arena_adopt(&p->arena, &a);
+        if (NULL != t)
+            __atomic_store_n(&p->tree, t, __ATOMIC_RELEASE);
+    }
+    *err = ctx.err;
+    t = p->tree;
+    pthread_mutex_unlock(&tree_lock);
+    arena_free(&a);
+    phase_end();
+
+    return t;
 }
 
-void
-do_build_tree(char *s, struct lacy_env *env)
+/* 
+ * Parse p and every page it inherits or includes, so that rendering it
+ * can not run into a syntax error. The first error is added to err.
+ */
+bool
+page_check(struct page *p, struct ut_str *err)
 {
-    int escaped = 0;
-    struct page *p = env_get_page(env);
-    struct ut_str buffer;
-    str_init(&buffer);
+    bool ok;
+    struct hash_map seen;
 
-    while (*s != '\0') {
-        if (*s == '\\') {
-            escaped = 1;
-            s++;
+    map_init(&seen);
+    ok = page_check_tree(p, &seen, err);
+    map_free(&seen, NULL);
+    return ok;
+}
+
+bool
+page_check_tree(struct page *p, struct hash_map *seen, struct ut_str *err)
+{
+    const char *msg;
+    struct tree_node *t;
+
+    for (; NULL != p; p = p->inherits) {
+        /* includes may well be circular */
+        if (NULL != map_get(seen, p->src_path))
+            return true;
+        map_put(seen, p->src_path, p);
+
+        if (NULL == (t = page_parse(p, &msg))) {
+            str_append_str(err, p->src_path);
+            str_append_str(err, ": ");
+            str_append_str(err, msg);
+            str_append(err, '\n');
+            return false;
         }
-        if (slook_ahead(s, "{{", 2)) {
-            if (escaped) {
-                str_append(&buffer, *s);
-                escaped = 0;
-            } 
-            else {
-                s += 2;
-                tree_push(BLOCK, buffer.s);
-                str_clear(&buffer);
-                s = parse_var(s, p, env);
-                continue;
-            }
+        for (; END != t->token; ++t) {
+            if (INCLUDE == t->token && !page_check_tree(t->page, seen, err))
+                return false;
         }
-        else if (slook_ahead(s, "{%", 2)) {
-            if (escaped) {
-                str_append(&buffer, *s);
-                escaped = 0;
-            } 
-            else {
-                s += 2;
-                tree_push(BLOCK, buffer.s);
-                str_clear(&buffer);
-                s = parse_expression(s, env);
-                continue;
+    }
+    return true;
+}
+
+/* 
+ * Literal text becomes BLOCK slices of the code. Only '{' and '\\' can
+ * start anything else, so the scan jumps from one to the next.
+ */
+void
+do_build_tree(char *s, struct tree_ctx *ctx)
+{
+    char *c, *start = s;
+
+    while (NULL != (c = strpbrk(s, "{\\"))) {
+        if ('\\' == *c) {
+            if ('{' == c[1] && ('{' == c[2] || '%' == c[2] || '$' == c[2])) {
+                /* drop the backslash, the brace is plain text */
+                if (c > start)
+                    tree_push(ctx, BLOCK, start, c - start);
+                start = c + 1;
+                s = c + 2;
             }
-        }
-        else if (slook_ahead(s, "{$", 2)) {
-            if (escaped) {
-                str_append(&buffer, *s);
-                escaped = 0;
-            } 
             else {
-                s += 2;
-                tree_push(BLOCK, buffer.s);
-                str_clear(&buffer);
-                s = parse_sh_exp(s, env);
-                continue;
+                /* any other escape is kept as written */
+                s = '\0' == c[1] ? c + 1 : c + 2;
             }
+            continue;
         }
-        else {
-            if (escaped) {
-                str_append(&buffer, '\\');
-                str_append(&buffer, *s);
-                escaped = 0;
-            } else {
-                str_append(&buffer, *s);
-            }
+        if ('{' != c[1] && '%' != c[1] && '$' != c[1]) {
+            s = c + 1;
+            continue;
         }
-        ++s;
+
+        if (c > start)
+            tree_push(ctx, BLOCK, start, c - start);
+        s = c + 2;
+        if ('{' == c[1])
+            s = parse_var(s, ctx);
+        else if ('%' == c[1])
+            s = parse_expression(s, ctx);
+        else
+            s = parse_sh_exp(s, ctx);
+        start = s;
     }
-    tree_push(BLOCK, buffer.s);
-    str_free(&buffer);
+    s = start + strlen(start);
+    if (s > start)
+        tree_push(ctx, BLOCK, start, s - start);
 }
 
 char *
-parse_var(char *s, struct page *p, struct lacy_env *env)
+parse_var(char *s, struct tree_ctx *ctx)
 {
-    struct ut_str var;
-    str_init(&var);
+    char *e;
+    struct ut_str *var = &ctx->name;
+    str_clear(var);
 
     while (*s != '\0') {
-        if (iswhitespace(*s) == 1) {
+        if (iswhitespace(*s)) {
             ++s;
-            continue;
         }
-
-        if ('.' == *s) {
-            tree_push(IDENT, var.s);
-            tree_push(MEMBER, NULL);
-            str_clear(&var);
+        else if ('.' == *s) {
+            tree_push(ctx, IDENT, var->s, var->len);
+            tree_push(ctx, MEMBER, NULL, 0);
+            str_clear(var);
+            ++s;
         }
-        else if (slook_ahead(s, "}}", 2)) {
+        else if ('}' == s[0] && '}' == s[1]) {
             s += 2;
-            if (0 == strcmp(var.s, "content")) {
-                if (env_has_next(env)) {
-                    env_inc(env);
-                    build_tree(env);
-                    env_dec(env);
-                }
+            if (0 == strcmp(var->s, "content")) {
+                tree_push(ctx, CONTENT, NULL, 0);
             }
             else {
-                tree_push(IDENT, var.s);
+                tree_push(ctx, IDENT, var->s, var->len);
             }
             break;
         }
         else {
-            str_append(&var, *s);
+            /* names are the words up to '.' or "}}", joined */
+            for (e = s + 1; *e != '\0' && !iswhitespace(*e) && '.' != *e 
+                    && !('}' == e[0] && '}' == e[1]); ++e)
+                ;
+            str_append_mem(var, s, e - s);
+            s = e;
         }
-        ++s;
     }
-    str_free(&var);
 
     return s;
 }
 
 char *
-parse_expression(char *s, struct lacy_env *env)
+parse_expression(char *s, struct tree_ctx *ctx)
 {
-    int t = next_token(&s);
+    int t = next_token(&s, ctx);
     switch (t) {
         case FOR:
-            tree_push(FOR, NULL);
-            s = parse_foreach(s, env);
+            tree_push(ctx, FOR, NULL, 0);
+            s = parse_foreach(s, ctx);
             break;
         case DONE:
-            tree_push(DONE, NULL);
+            tree_push(ctx, DONE, NULL, 0);
             break;
         case INCLUDE:
-            tree_push(INCLUDE, NULL);
-            s = parse_include(s, env);
+            s = parse_include(s, ctx);
             break;
         default:
-            fatal("excepted for\n");
+            return parse_fail(s, ctx, "excepted for");
     }
-    t = next_token(&s);
+    if (NULL != ctx->err)
+        return s;
+    t = next_token(&s, ctx);
     switch (t) {
         case EXP_END:
             break;
         default:
-            fatal("excepted expression end\n");
+            return parse_fail(s, ctx, "excepted expression end");
     }
     return s;
 }
 
 char *
-parse_include(char *s, struct lacy_env *env)
+parse_include(char *s, struct tree_ctx *ctx)
 {
+    char *name;
     struct page *p;
-    int t = next_token(&s);
+    int t = next_token(&s, ctx);
     switch (t) {
         case IDENT:
-            p = page_find(curtok.s);
-            do_build_tree(p->code, env);
+            name = arena_strndup(ctx->arena, ctx->tok, ctx->tok_len);
+            if (NULL == (p = page_load(name))) {
+                str_clear(&ctx->name);
+                str_append_str(&ctx->name, "included page not found: ");
+                str_append_str(&ctx->name, name);
+                return parse_fail(s, ctx, 
+                        arena_strdup(ctx->arena, ctx->name.s));
+            }
+            tree_push(ctx, INCLUDE, NULL, 0)->page = p;
             break;
         default:
-            fatal("excepted ident");
+            return parse_fail(s, ctx, "excepted ident");
     }
     return s;
 }
 
 char *
-parse_foreach(char *s, struct lacy_env *env)
+parse_foreach(char *s, struct tree_ctx *ctx)
 {
-    int t = next_token(&s);
+    int t = next_token(&s, ctx);
     switch (t) {
         case IDENT:
-            tree_push(IDENT, curtok.s);
+            tree_push(ctx, IDENT, ctx->tok, ctx->tok_len);
             break;
         default:
-            fatal("excepted ident");
+            return parse_fail(s, ctx, "excepted ident");
     }
-    t = next_token(&s);
+    t = next_token(&s, ctx);
     switch (t) {
         case IN:
             break;
         default:
-            fatal("excepted IN");
+            return parse_fail(s, ctx, "excepted IN");
     }
-    t = next_token(&s);
+    t = next_token(&s, ctx);
     switch (t) {
         case IDENT:
-            tree_push(IDENT, curtok.s);
+            tree_push(ctx, IDENT, ctx->tok, ctx->tok_len);
             break;
         case SH_START:
-            s = parse_sh_exp(s, env);
+            s = parse_sh_exp(s, ctx);
             break;
         default:
-            fatal("excepted List or Shell expression");
+            return parse_fail(s, ctx, "excepted List or Shell expression");
     }
-    t = next_token(&s);
+    t = next_token(&s, ctx);
     switch (t) {
         case DO:
-            tree_push(DO, NULL);
+            tree_push(ctx, DO, NULL, 0);
             break;
         default:
-            fatal("excepted DO");
+            return parse_fail(s, ctx, "excepted DO");
     }
     return s;
 }
 
 char *
-parse_sh_exp(char *s, struct lacy_env *env)
+parse_sh_exp(char *s, struct tree_ctx *ctx)
 {
-    struct ut_str var;
-    str_init(&var);
+    char *e;
 
-    while (*s != '\0') {
-        if (slook_ahead(s, "$}", 2)) {
-            s += 2;
-            tree_push(SH_BLOCK, var.s);
-            break;
-        }
-        else {
-            str_append(&var, *s);
-        }
-        ++s;
-    }
-    str_free(&var);
+    if (NULL == (e = strstr(s, "$}")))
+        return s + strlen(s);
 
-    return s;
+    tree_push(ctx, SH_BLOCK, s, e - s);
+    return e + 2;
 }
 
+/* keep the first error and skip to the end of the page */
+char *
+parse_fail(char *s, struct tree_ctx *ctx, const char *err)
+{
+    if (NULL == ctx->err)
+        ctx->err = err;
+    return s + strlen(s);
+}
 
 void 
-write_tree(FILE *out, struct lacy_env *env)
+write_tree(struct ut_str *out, struct lacy_env *env)
 {
-    struct tree_node *tmp, *top;
-
-    top = tree_top;
-    do_write_tree(out, env, top);
+    if (ENGINE_VM == engine)
+        run_page(out, env, env_get_page(env), env_has_next(env));
+    else
+        do_write_tree(out, env, page_tree(env_get_page(env)));
+}
 
-    while (top != NULL) {
-        tmp = top;
-        top = top->next;
-        if (NULL != tmp)
-            free(tmp);  
+/* bytecode of p, compiled once from its template like page_tree() */
+struct prog *
+page_prog(struct page *p)
+{
+    struct tree_node *t;
+    struct prog *pr = __atomic_load_n(&p->prog, __ATOMIC_ACQUIRE);
+    if (NULL != pr)
+        return pr;
+
+    t = page_tree(p);
+    pthread_mutex_lock(&tree_lock);
+    if (NULL == p->prog) {
+        phase_begin(PH_COMPILE, p->src_path);
+        __atomic_store_n(&p->prog, prog_compile(&p->arena, t), 
+                __ATOMIC_RELEASE);
+        phase_end();
     }
-    tree_top = NULL;
+    pr = p->prog;
+    pthread_mutex_unlock(&tree_lock);
+
+    return pr;
 }
 
-void 
-do_write_tree(FILE *out, struct lacy_env *env, struct tree_node *top)
+/* 
+ * One instruction per node that writes anything. Jumps over a member
+ * are first recorded as node indexes and resolved at the end, loops
+ * are patched when their OP_NEXT is emitted.
+ */
+struct prog *
+prog_compile(struct arena *a, struct tree_node *t)
 {
-    struct tree_node *t = top;
-    while (t != NULL) {
-        switch (t->token) {
+    int i, n, k = 0, nopen = 0;
+    int *at, *open;
+    struct insn *code, *in;
+    struct prog *pr = arena_alloc(a, sizeof(struct prog));
+
+    for (n = 0; END != t[n].token; ++n)
+        ;
+    at = malloc((n + 1) * sizeof(int));
+    open = malloc((n + 1) * sizeof(int));
+    code = malloc((2 * n + 1) * sizeof(struct insn));
+    pr->max_loops = 0;
+
+    for (i = 0; i < n; ++i) {
+        at[i] = k;
+        in = &code[k];
+        memset(in, 0, sizeof(struct insn));
+        in->op = OP_HALT;
+        in->slot = t[i].slot;
+
+        switch (t[i].token) {
         case BLOCK:
-            fputs(t->buffer.s, out);
+            in->op = OP_LIT;
+            in->u.s = t[i].buffer;
+            in->len = t[i].len;
+            break;
+        case IDENT:
+            if (SYM_ROOT == t[i].slot) {
+                in->op = OP_ROOT;
+            }
+            else if (NULL == t[i].link) {
+                in->op = SYM_THIS == t[i].slot ? OP_THIS : OP_VAR;
+            }
+            else {
+                in->op = SYM_THIS == t[i].slot ? OP_THIS_MEMBER 
+                                               : OP_VAR_MEMBER;
+                in->member = t[i].link->slot;
+                in->jump = t[i].link - t + 1;
+            }
+            break;
+        case CONTENT:
+            in->op = OP_CONTENT;
             break;
         case INCLUDE:
-            t = write_include(out, t, env);
+            in->op = OP_INCLUDE;
+            in->u.page = t[i].page;
             break;
-        case IDENT:
-            t = write_var(out, t, env);
+        case SH_BLOCK:
+            in->op = OP_SH;
+            in->u.s = t[i].buffer;
             break;
         case FOR:
-            t = write_for(out, t, env);
+            in->op = SH_BLOCK == t[i + 2].token ? OP_LOOP_SH : OP_LOOP_DIR;
+            in->slot = t[i + 1].slot;
+            in->u.s = t[i + 2].buffer;
+            open[nopen++] = k;
+            if (nopen > pr->max_loops)
+                pr->max_loops = nopen;
+            /* the variable, list and do belong to the loop */
+            at[++i] = k;
+            at[++i] = k;
+            at[++i] = k;
             break;
         case DONE:
-            return;
-        case SH_BLOCK:
-            write_sh_block(out, t, env);
+            if (nopen > 0) {
+                in->op = OP_NEXT;
+                code[open[--nopen]].jump = k + 1;
+            }
+            /* a stray done ends the template */
             break;
         default:
-            break;
+            continue;
         }
-        t = t->next;
+        k++;
     }
-}
+    at[n] = k;
+    /* loops without done run to the end */
+    while (nopen > 0) {
+        memset(&code[k], 0, sizeof(struct insn));
+        code[k].op = OP_NEXT;
+        code[open[--nopen]].jump = k + 1;
+        k++;
+    }
+    memset(&code[k], 0, sizeof(struct insn));
+    code[k++].op = OP_HALT;
 
-struct tree_node * 
-write_include(FILE *out, struct tree_node *t, struct lacy_env *env)
-{
-    if (t->next != NULL && IDENT == t->next->token) {
-        t = t->next;
-        if (NULL != t) {
-            struct page *p = page_find(t->buffer.s);
-            t = write_member(out, t, p, env);
-        }
-        t = t->next;
+    for (i = 0; i < k; ++i) {
+        if (OP_THIS_MEMBER == code[i].op || OP_VAR_MEMBER == code[i].op)
+            code[i].jump = at[code[i].jump];
     }
-    return t;
+
+    pr->n = k;
+    pr->code = arena_alloc(a, k * sizeof(struct insn));
+    memcpy(pr->code, code, k * sizeof(struct insn));
+    free(code);
+    free(open);
+    free(at);
+
+    return pr;
 }
 
-struct tree_node * 
-write_var(FILE *out, struct tree_node *t, struct lacy_env *env)
+void
+vm_run(struct ut_str *out, struct lacy_env *env, struct prog *pr)
 {
-    if (0 == strcmp(t->buffer.s, "root")) {
-        write_depth(out, env);
-    }
-    else if (0 == strcmp(t->buffer.s, "this")) {
-        struct page *p = env_get_page_top(env);
-        if (NULL != p) {
-            if (t->next != NULL && MEMBER == t->next->token) {
-                t = t->next->next;
-                t = write_member(out, t, p, env);
+    int pc = 0, nloops = 0;
+    struct insn *in;
+    struct page *p;
+    struct vm_loop *l, *loops = NULL;
+    struct sh_result *r;
+    char *a;
+
+    if (pr->max_loops > 0)
+        loops = arena_alloc(env->arena, 
+                pr->max_loops * sizeof(struct vm_loop));
+
+    while (true) {
+        in = &pr->code[pc++];
+        switch (in->op) {
+        case OP_LIT:
+            str_append_mem(out, in->u.s, in->len);
+            break;
+        case OP_ROOT:
+            write_depth(out, env);
+            break;
+        case OP_THIS:
+            if (NULL != (p = env_get_page_top(env)))
+                str_append_str(out, p->file_path);
+            break;
+        case OP_THIS_MEMBER:
+            if (NULL != (p = env_get_page_top(env))) {
+                write_attr(out, p, in->member, env);
+                pc = in->jump;
             }
-            else {
-                fprintf(out, "%s", p->file_path);
+            break;
+        case OP_VAR:
+            if (env_inherits(env) 
+             && NULL != (a = env_attr_lookup(env, in->slot)))
+                str_append_str(out, a);
+            break;
+        case OP_VAR_MEMBER:
+            if (env_inherits(env)) {
+                write_var_member(out, env, in->slot, in->member);
+                pc = in->jump;
             }
-        }
-    }
-    else {
-        if (env_has_next(env)) {
-            struct page_attr *a;
-            a = env_attr_lookup(env, t->buffer.s);
-            if (t->next != NULL && MEMBER == t->next->token) {
-                t = t->next->next;
-                if (NULL != a) {
-                    struct page *p = page_find(a->value.s);
-                    t = write_member(out, t, p, env);
-                }
+            break;
+        case OP_CONTENT:
+            if (env_has_next(env)) {
+                env_inc(env);
+                run_page(out, env, env_get_page(env), env_has_next(env));
+                env_dec(env);
             }
-            else 
-            {
-                if (NULL != a) {
-                    fprintf(out, "%s", a->value.s);
-                }
+            break;
+        case OP_INCLUDE:
+            env_add_dep(env, in->u.page->src_path);
+            run_page(out, env, in->u.page, true);
+            break;
+        case OP_SH:
+            r = sh_exec(in->u.s);
+            str_append_mem(out, r->out, r->len);
+            break;
+        case OP_LOOP_SH:
+        case OP_LOOP_DIR:
+            l = &loops[nloops];
+            l->body = pc;
+            l->slot = in->slot;
+            l->r = NULL;
+            l->pos = 0;
+            l->dl = NULL;
+            l->idx = 0;
+            if (OP_LOOP_SH == in->op) {
+                l->r = sh_exec(in->u.s);
+            }
+            else {
+                /* the listing changes whenever the directory mtime does */
+                env_add_dep(env, in->u.s);
+                l->dl = dir_lookup(in->u.s);
             }
+            if (vm_loop_next(env, l))
+                nloops++;
+            else
+                pc = in->jump;
+            break;
+        case OP_NEXT:
+            l = &loops[nloops - 1];
+            if (vm_loop_next(env, l))
+                pc = l->body;
+            else
+                nloops--;
+            break;
+        case OP_HALT:
+            return;
         }
     }
-    return t;
 }
 
-struct tree_node *
-write_member(FILE *out, struct tree_node *t, 
-             struct page *p, struct lacy_env *env) 
+/* 
+ * Bind the next item of l. Shell output is split on whitespace and a
+ * last word without whitespace after it is not an item.
+ */
+bool
+vm_loop_next(struct lacy_env *env, struct vm_loop *l)
 {
-    struct page_attr *pa;
-    /* the attribute does not exist in page */
-    if (NULL == p) 
-        return t;
+    size_t start;
+    struct sh_result *r = l->r;
 
-    pa = page_attr_lookup(p, t->buffer.s);
-    /* the page has the member */
-    if (NULL != pa) 
-        fprintf(out, "%s", pa->value.s);
+    if (NULL == r) {
+        if (l->idx >= l->dl->n)
+            return false;
+        env_set_entry(env, l->slot, &l->dl->entries[l->idx++]);
+        return true;
+    }
 
-    return t;
+    while (l->pos < r->len && iswhitespace(r->out[l->pos]))
+        l->pos++;
+    start = l->pos;
+    while (l->pos < r->len && !iswhitespace(r->out[l->pos]))
+        l->pos++;
+    if (l->pos >= r->len)
+        return false;
+
+    env_slot(env, l->slot)->value = arena_strndup(env->arena, 
+            r->out + start, l->pos - start);
+    return true;
 }
 
-void 
-write_sh_block(FILE *out, struct tree_node *t, struct lacy_env *env)
+/* 
+ * Layouts and included pages run natively with --native, everything
+ * else and any layout that failed to build runs on the vm.
+ */
+void
+run_page(struct ut_str *out, struct lacy_env *env, struct page *p, 
+         bool layout)
 {
-    char c;
-    FILE *cmd;
+    native_fn fn;
 
-    cmd = popen(t->buffer.s, "r");
-    while ((c = fgetc(cmd)) != EOF) {
-        fputc(c, out);
+    if (layout && __atomic_load_n(&native_mode, __ATOMIC_RELAXED) 
+     && NULL != (fn = page_native(p))) {
+        fn(&native_rt, out, env);
+        return;
     }
-    fclose(cmd);
+    vm_run(out, env, page_prog(p));
 }
 
-struct tree_node *
-write_for(FILE *out, struct tree_node *t, struct lacy_env *env)
+native_fn
+page_native(struct page *p)
 {
-    DIR *d;
-    struct tree_node *var, *list;
-    struct dirent *de; 
-
-    /* Pop var IDENT */
-    t = t->next; var = t;        
-    /* Pop var list IDENT */
-    t = t->next; list = t;        
-    t = t->next;
-
-    if (list->token == SH_BLOCK) {
-        char c;
-        struct ut_str file_path;
-        str_init(&file_path);
+    native_fn fn;
+
+    if (__atomic_load_n(&p->native_tried, __ATOMIC_ACQUIRE))
+        return p->native;
+
+    pthread_mutex_lock(&native_lock);
+    if (!p->native_tried) {
+        phase_begin(PH_COMPILE, p->src_path);
+        p->native = __atomic_load_n(&native_mode, __ATOMIC_RELAXED) 
+                  ? native_build(page_prog(p)) : NULL;
+        phase_end();
+        __atomic_store_n(&p->native_tried, true, __ATOMIC_RELEASE);
+    }
+    fn = p->native;
+    pthread_mutex_unlock(&native_lock);
 
-        FILE *cmd = popen(list->buffer.s, "r");
-        while ((c = fgetc(cmd)) != EOF) {
-            if (!iswhitespace(c)) {
-                str_append(&file_path, c);
-            }
-            else {
-                if (!str_is_empty(&file_path)) {
-                    env_set(env, var->buffer.s, file_path.s);
-                    do_write_tree(out, env, t);
+    return fn;
+}
 
-                    str_clear(&file_path);
-                }
-            }
+/* 
+ * Generate C for pr, build it unless the cache has an object for the 
+ * same source and load it. Symbols and pages are looked up by name
+ * when the object is loaded since slots differ between runs.
+ */
+native_fn
+native_build(struct prog *pr)
+{
+    int i, nsyms = 0, npages = 0;
+    int *syms = NULL, *slots;
+    struct page **pages = NULL;
+    const char **names, **page_names;
+    void **page_ptrs;
+    void *h;
+    native_fn fn = NULL;
+    struct ut_str src, c_path, so_path;
+
+    if (pr->n > NATIVE_MAX)
+        return NULL;
+
+    str_init(&src);
+    str_init(&c_path);
+    str_init(&so_path);
+    native_gen(pr, &src, &syms, &nsyms, &pages, &npages);
+
+    if (!cache_path("native", hash_mem(src.s, src.len), &so_path)) 
+        goto out;
+    str_append_str(&c_path, so_path.s);
+    str_append_str(&c_path, ".c");
+    str_append_str(&so_path, ".so");
+
+    if (!file_exists(so_path.s)) {
+        if (!write_file_atomic(c_path.s, src.s, src.len)
+         || !native_compile(c_path.s, so_path.s)) {
+            warn("Unable to compile layouts, using the interpreter\n");
+            __atomic_store_n(&native_mode, false, __ATOMIC_RELAXED);
+            goto out;
         }
-        fclose(cmd);
-        str_free(&file_path);
+        /* only kept when the build fails, to look at */
+        unlink(c_path.s);
     }
-    else if (file_exists(list->buffer.s)) {
-        /* Read directory */
-        if (NULL != (d = opendir(list->buffer.s))) {
-            while ((de = readdir(d)) != NULL) {
-                if (strcmp(de->d_name, ".") == 0 
-                || strcmp(de->d_name, "..") == 0)
-                    continue;
 
-                env_set(env, var->buffer.s, de->d_name);
-                do_write_tree(out, env, t);
-            }
-            closedir(d);
-        }
+    if (NULL == (h = dlopen(so_path.s, RTLD_NOW | RTLD_LOCAL))) {
+        warn("Unable to load %s: %s\n", so_path.s, dlerror());
+        goto out;
+    }
+    fn = (native_fn)dlsym(h, "lacy_render");
+
+    /* 
+     * Layouts with the same source share the object, which was set up
+     * when it was first loaded and may be running on other threads.
+     */
+    for (i = 0; i < native_nhandles && native_handles[i] != h; ++i)
+        ;
+    if (i < native_nhandles) {
+        dlclose(h);
+        goto out;
     }
 
-    while (t->scope != var->scope) 
-        t = t->next;
-
-    return t;
+    slots = dlsym(h, "lacy_slots");
+    names = dlsym(h, "lacy_sym_names");
+    page_ptrs = dlsym(h, "lacy_pages");
+    page_names = dlsym(h, "lacy_page_names");
+    if (NULL == slots || NULL == names || NULL == page_ptrs 
+     || NULL == page_names || NULL == fn) {
+        warn("Unable to load %s\n", so_path.s);
+        dlclose(h);
+        fn = NULL;
+        goto out;
+    }
+    for (i = 0; i < nsyms; ++i) 
+        slots[i] = sym_intern(names[i]);
+    for (i = 0; i < npages; ++i) 
+        page_ptrs[i] = page_find((char *)page_names[i]);
+    native_handles = realloc(native_handles, 
+            (native_nhandles + 1) * sizeof(void *));
+    native_handles[native_nhandles++] = h;
+
+out:
+    free(syms);
+    free(pages);
+    str_free(&so_path);
+    str_free(&c_path);
+    str_free(&src);
+    return fn;
 }
 
+/* 
+ * One statement per instruction, labelled by its pc when it is a jump 
+ * target. Values live in v[] until content, an include or a loop step may
+ * have rebound a variable. The code is cut into functions of about 
+ * NATIVE_CHUNK instructions wherever no loop or jump spans the cut, each
+ * returns non-zero when the template halted.
+ */
 void
-write_depth(FILE *out, struct lacy_env *env)
+native_gen(struct prog *pr, struct ut_str *src, int **syms, int *nsyms, 
+           struct page ***pages, int *npages)
 {
-    int d;
-    if (env->depth > 0) {
-        for (d = 1; d < env->depth; ++d) {
-            fprintf(out, "../");
+    int i, k, m, c, nkeys = 0, depth = 0, *body, *keys = NULL;
+    int start = 0, reach = 0, nchunks = 0;
+    bool *target;
+    char buf[160];
+    struct insn *in;
+    struct ut_str lits, code;
+
+    str_init(&lits);
+    str_init(&code);
+    body = malloc((pr->max_loops + 1) * sizeof(int));
+    target = calloc(pr->n + 1, sizeof(bool));
+    for (i = 0; i < pr->n; ++i) {
+        in = &pr->code[i];
+        if (OP_THIS_MEMBER == in->op || OP_VAR_MEMBER == in->op)
+            target[in->jump] = true;
+        if (OP_LOOP_SH == in->op || OP_LOOP_DIR == in->op)
+            target[in->jump] = target[i + 1] = true;
+    }
+
+    for (i = 0; i < pr->n; ++i) {
+        in = &pr->code[i];
+        if (0 == i || (0 == depth && reach < i && i - start >= NATIVE_CHUNK)) {
+            if (i > 0)
+                str_append_str(&code, "    return 0;\n}\n");
+            snprintf(buf, sizeof(buf), "static int NOINLINE\nchunk%d("
+                    "const struct lacy_rt *rt, struct lacy_out *out, "
+                    "void *env, struct lacy_val *v)\n{\n", nchunks++);
+            str_append_str(&code, buf);
+            for (k = 0; k < pr->max_loops; ++k) {
+                snprintf(buf, sizeof(buf), "    void *l%d;\n", k);
+                str_append_str(&code, buf);
+            }
+            str_append_str(&code, "    int c;\n    size_t n;\n    "
+                    "const char *s;\n    (void)c; (void)n; (void)s;\n");
+            start = i;
+        }
+        if (target[i]) {
+            snprintf(buf, sizeof(buf), "L%d: ", i);
+            str_append_str(&code, buf);
+        }
+        if (in->jump > reach)
+            reach = in->jump;
+
+        switch (in->op) {
+        case OP_LIT:
+            snprintf(buf, sizeof(buf), "static const char lit%d[] = ", i);
+            str_append_str(&lits, buf);
+            native_quote(&lits, in->u.s, in->len);
+            str_append_str(&lits, ";\n");
+            snprintf(buf, sizeof(buf), "put(rt, out, lit%d, %u);\n", 
+                    i, in->len);
+            break;
+        case OP_ROOT:
+        case OP_THIS:
+            c = native_key(&keys, &nkeys, in->op, 0, 0);
+            snprintf(buf, sizeof(buf), 
+                    "if (!v[%d].state) val(&v[%d], rt->%s(env), 1); "
+                    "put(rt, out, v[%d].s, v[%d].n);\n", c, c, 
+                    OP_ROOT == in->op ? "root" : "self", c, c);
+            break;
+        case OP_VAR:
+            k = native_index(syms, nsyms, in->slot);
+            c = native_key(&keys, &nkeys, in->op, k, 0);
+            snprintf(buf, sizeof(buf), 
+                    "if (!v[%d].state) val(&v[%d], rt->var(env, S(%d)), 1); "
+                    "put(rt, out, v[%d].s, v[%d].n);\n", c, c, k, c, c);
+            break;
+        case OP_THIS_MEMBER:
+        case OP_VAR_MEMBER:
+            k = native_index(syms, nsyms, in->slot);
+            m = native_index(syms, nsyms, in->member);
+            c = native_key(&keys, &nkeys, in->op, k, m);
+            if (OP_THIS_MEMBER == in->op)
+                snprintf(buf, sizeof(buf), "if (!v[%d].state) "
+                        "{ n = rt->self_member(env, S(%d), &s); ", c, m);
+            else
+                snprintf(buf, sizeof(buf), "if (!v[%d].state) "
+                        "{ n = rt->var_member(env, S(%d), S(%d), &s); ", 
+                        c, k, m);
+            str_append_str(&code, buf);
+            snprintf(buf, sizeof(buf), "val(&v[%d], s, 1 + n); } "
+                    "put(rt, out, v[%d].s, v[%d].n); "
+                    "if (2 == v[%d].state) goto L%d;\n", 
+                    c, c, c, c, in->jump);
+            break;
+        case OP_CONTENT:
+            snprintf(buf, sizeof(buf), 
+                    "rt->content(out, env); RESET;\n");
+            break;
+        case OP_INCLUDE:
+            for (k = 0; k < *npages && (*pages)[k] != in->u.page; ++k)
+                ;
+            if (k == *npages) {
+                *pages = realloc(*pages, (k + 1) * sizeof(struct page *));
+                (*pages)[(*npages)++] = in->u.page;
+            }
+            snprintf(buf, sizeof(buf), 
+                    "rt->include(out, env, lacy_pages[%d]); RESET;\n", k);
+            break;
+        case OP_SH:
+            str_append_str(&code, "s = rt->sh(");
+            native_quote(&code, in->u.s, strlen(in->u.s));
+            snprintf(buf, sizeof(buf), ", &n); put(rt, out, s, n);\n");
+            break;
+        case OP_LOOP_SH:
+        case OP_LOOP_DIR:
+            body[depth] = i + 1;
+            snprintf(buf, sizeof(buf), "l%d = rt->%s(env, S(%d), ",
+                    depth, OP_LOOP_SH == in->op ? "loop_sh" : "loop_dir",
+                    native_index(syms, nsyms, in->slot));
+            str_append_str(&code, buf);
+            native_quote(&code, in->u.s, strlen(in->u.s));
+            snprintf(buf, sizeof(buf), 
+                    "); RESET; if (NULL == l%d) goto L%d;\n", 
+                    depth, in->jump);
+            depth++;
+            break;
+        case OP_NEXT:
+            depth--;
+            snprintf(buf, sizeof(buf), 
+                    "c = rt->loop_next(env, l%d); RESET; if (c) goto L%d;\n",
+                    depth, body[depth]);
+            break;
+        case OP_HALT:
+            snprintf(buf, sizeof(buf), "return 1;\n");
+            break;
         }
-        fprintf(out, "..");
+        str_append_str(&code, buf);
     }
-    else {
-        fprintf(out, ".");
+
+    str_append_str(&code, "    return 0;\n}\n");
+
+    str_append_str(src, "/* " NATIVE_ABI " */\n" NATIVE_HEADER);
+    snprintf(buf, sizeof(buf), 
+            "int lacy_slots[%d];\nvoid *lacy_pages[%d];\n#define NV %d\n",
+            *nsyms + 1, *npages + 1, nkeys + 1);
+    str_append_str(src, buf);
+    str_append_str(src, "const char *lacy_sym_names[] = {\n");
+    pthread_mutex_lock(&sym_lock);
+    for (i = 0; i < *nsyms; ++i) {
+        native_quote(src, sym_names[(*syms)[i]], 
+                strlen(sym_names[(*syms)[i]]));
+        str_append_str(src, ",\n");
+    }
+    pthread_mutex_unlock(&sym_lock);
+    str_append_str(src, "0 };\n");
+    /* includes by path, so the source and its object differ with them */
+    str_append_str(src, "const char *lacy_page_names[] = {\n");
+    for (i = 0; i < *npages; ++i) {
+        native_quote(src, (*pages)[i]->src_path, 
+                strlen((*pages)[i]->src_path));
+        str_append_str(src, ",\n");
+    }
+    str_append_str(src, "0 };\n");
+    str_append_mem(src, lits.s, lits.len);
+    str_append_mem(src, code.s, code.len);
+    str_append_str(src, "void\nlacy_render(const struct lacy_rt *rt, "
+            "struct lacy_out *out, void *env)\n{\n"
+            "    struct lacy_val v[NV];\n    RESET;\n");
+    for (i = 0; i < nchunks; ++i) {
+        snprintf(buf, sizeof(buf), 
+                "    if (chunk%d(rt, out, env, v))\n        return;\n", i);
+        str_append_str(src, buf);
     }
+    str_append_str(src, "}\n");
+
+    free(target);
+    free(keys);
+    free(body);
+    str_free(&code);
+    str_free(&lits);
 }
 
-struct page_attr * 
-env_attr_lookup(struct lacy_env *e, char *s)
+/* index of slot x in the symbol table of the module, -1 stays -1 */
+int
+native_index(int **v, int *n, int x)
 {
-    struct page_attr *t = e->sym_tbl;
-    while (t != NULL) {
-        if (0 == strcmp(t->name.s, s))
-            return t;
+    int i;
 
-        t = t->next;
+    if (x < 0)
+        return -1;
+    for (i = 0; i < *n; ++i) {
+        if ((*v)[i] == x)
+            return i;
     }
-    return NULL;
+    *v = realloc(*v, (*n + 1) * sizeof(int));
+    (*v)[*n] = x;
+    return (*n)++;
 }
 
-void 
-usage()
+/* index of the cached value of op on (a, b) */
+int
+native_key(int **v, int *n, int op, int a, int b)
 {
-printf("Usage: " PACKAGE_NAME " [OPTION]... [FILE]... \n\
-  -h, --help      Show usage information\n\
-  -q, --quiet     Supress all output\n\
-  -v, --verbose   Increase verbosity\n\
-  -V, --version   Print version\n\
-");
-    exit(EXIT_SUCCESS);
-}
+    int i;
 
-void 
-version()
-{
-    printf(PACKAGE_NAME " version " PACKAGE_VERSION " (" PACKAGE_URL ") \n");
-    exit(EXIT_SUCCESS);
+    for (i = 0; i < *n; ++i) {
+        if ((*v)[3 * i] == op && (*v)[3 * i + 1] == a && (*v)[3 * i + 2] == b)
+            return i;
+    }
+    *v = realloc(*v, 3 * (*n + 1) * sizeof(int));
+    (*v)[3 * i] = op;
+    (*v)[3 * i + 1] = a;
+    (*v)[3 * i + 2] = b;
+    return (*n)++;
 }
 
-
-void 
-str_resize(struct ut_str *u, long ns)
+/* C string literal of n bytes */
+void
+native_quote(struct ut_str *dst, const char *s, size_t n)
 {
-    while (u->len + ns >= u->size) {
-        u->size += u->def_size;
-        u->s = realloc(u->s, u->size);
+    size_t i;
+    char oct[8];
+    unsigned char c;
+
+    str_append(dst, '"');
+    for (i = 0; i < n; ++i) {
+        c = s[i];
+        if (c >= ' ' && c < 127 && '"' != c && '\\' != c && '?' != c) {
+            str_append(dst, c);
+        }
+        else {
+            snprintf(oct, sizeof(oct), "\\%03o", c);
+            str_append_str(dst, oct);
+        }
+        if ('\n' == c)
+            str_append_str(dst, "\"\n\"");
     }
+    str_append(dst, '"');
 }
 
-void
-str_init(struct ut_str *u)
+/* $CC or cc builds c_path into so_path */
+bool
+native_compile(const char *c_path, const char *so_path)
 {
-    u->len = 0;
-    u->size = BUFSIZ;
-    u->def_size = BUFSIZ;
-    u->s = malloc(sizeof(char) * BUFSIZ);
-    memset(u->s, '\0', BUFSIZ);
+    int rc;
+    const char *cc = getenv("CC");
+    struct ut_str cmd, tmp;
+
+    str_init(&cmd);
+    str_init(&tmp);
+    str_append_str(&tmp, so_path);
+    str_append_str(&tmp, ".tmp");
+
+    str_append_str(&cmd, NULL != cc && '\0' != *cc ? cc : "cc");
+    str_append_str(&cmd, " -O2 -shared -fPIC -w -o '");
+    str_append_str(&cmd, tmp.s);
+    str_append_str(&cmd, "' '");
+    str_append_str(&cmd, c_path);
+    str_append_str(&cmd, verbosity > 1 ? "'" : "' >/dev/null 2>&1");
+
+    if (verbosity > 1)
+        printf("Compiling %s\n", c_path);
+    rc = system(cmd.s);
+    if (0 == rc && 0 != rename(tmp.s, so_path))
+        rc = -1;
+    if (0 != rc)
+        unlink(tmp.s);
+
+    str_free(&tmp);
+    str_free(&cmd);
+    return 0 == rc;
 }
 
-/* XXX: fix me */
 void
-str_append(struct ut_str *u, char c) 
+native_free()
 {
-    str_resize(u, 1);
-    u->s[u->len] = c;
-    u->len++;
-    u->s[u->len] = '\0';
+    int i;
+    for (i = 0; i < native_nhandles; ++i)
+        dlclose(native_handles[i]);
+    free(native_handles);
+    native_handles = NULL;
+    native_nhandles = 0;
 }
 
-/* XXX: fix me */
 void
-str_append_str(struct ut_str *u, char *s) 
+rt_grow(void *out, const char *s, size_t n)
 {
-    long l = strlen(s);
-    str_resize(u, l);
-    u->len += l;
-    strcat(u->s, s);
-    u->s[u->len] = '\0';
+    str_append_mem(out, s, n);
 }
 
-void 
-str_trim(struct ut_str *u)
+const char *
+rt_root(void *env)
 {
-    char *str = u->s;
-    char *s = str;
-    while (iswhitespace(*s) == 1 && *s != '\0') 
-        s++;
-
-    while (*s != '\0') {
-        *str = *s;
-        str++; s++;
-    }
-    *str = '\0';
-    str--;
-    while (iswhitespace(*str)) {
-        *str = '\0';
-        s--;
-    }
+    struct ut_str u;
+    str_init(&u);
+    write_depth(&u, env);
+    return rt_value(env, &u);
 }
 
-int 
-iswhitespace(char c)
+const char *
+rt_self(void *env)
 {
-    return c == ' ' || isnewline(c);
+    struct page *p = env_get_page_top(((struct lacy_env *)env));
+    return NULL != p ? p->file_path : NULL;
 }
 
 int
-isnewline(char c)
+rt_self_member(void *env, int member, const char **value)
 {
-    return c == '\n' || c == '\r';
+    struct ut_str u;
+    struct page *p = env_get_page_top(((struct lacy_env *)env));
+
+    *value = NULL;
+    if (NULL == p)
+        return 0;
+    str_init(&u);
+    write_attr(&u, p, member, env);
+    *value = rt_value(env, &u);
+    return 1;
+}
+
+const char *
+rt_var(void *env, int slot)
+{
+    if (!env_inherits(((struct lacy_env *)env)))
+        return NULL;
+    return env_attr_lookup(env, slot);
 }
 
 int
-str_is_empty(struct ut_str *u)
+rt_var_member(void *env, int slot, int member, const char **value)
 {
-    if (u->len <= 0)
-        return 1;
+    struct ut_str u;
 
-    return 0;
+    *value = NULL;
+    if (!env_inherits(((struct lacy_env *)env)))
+        return 0;
+    str_init(&u);
+    write_var_member(&u, env, slot, member);
+    *value = rt_value(env, &u);
+    return 1;
+}
+
+/* copy of u in the page arena, u is freed */
+const char *
+rt_value(struct lacy_env *env, struct ut_str *u)
+{
+    char *s = NULL;
+    if (u->len > 0)
+        s = arena_strndup(env->arena, u->s, u->len);
+    str_free(u);
+    return s;
 }
 
 void
-str_clear(struct ut_str *u)
+rt_content(void *out, void *arg)
 {
-    u->len = 0;
-    u->size = u->def_size;
-    u->s = realloc(u->s, u->size);
-    memset(u->s, '\0', u->size);
+    struct lacy_env *env = arg;
+    if (env_has_next(env)) {
+        env_inc(env);
+        run_page(out, env, env_get_page(env), env_has_next(env));
+        env_dec(env);
+    }
 }
 
 void
-str_free(struct ut_str *u)
+rt_include(void *out, void *env, void *page)
 {
-    if (NULL != u->s) 
-        free(u->s);
+    struct page *p = page;
+    env_add_dep(env, p->src_path);
+    run_page(out, env, p, true);
 }
 
-bool
-file_exists(char *s)
+const char *
+rt_sh(const char *cmd, size_t *n)
 {
-    FILE *f = fopen(s, "r");
-    if (NULL == f) {
-        return false;
-    }
-    fclose(f);
-    return true;
+    struct sh_result *r = sh_exec(cmd);
+    *n = r->len;
+    return r->out;
+}
 
+void *
+rt_loop_sh(void *env, int slot, const char *cmd)
+{
+    struct vm_loop *l = rt_loop(env, slot);
+    l->r = sh_exec(cmd);
+    return vm_loop_next(env, l) ? l : NULL;
 }
 
-int
-build_depth(char *file_path) 
+void *
+rt_loop_dir(void *env, int slot, const char *path)
 {
-    char *s;
-    int depth = 0;
-    struct ut_str buf;
-    str_init(&buf);
+    struct vm_loop *l = rt_loop(env, slot);
+    /* the listing changes whenever the directory mtime does */
+    env_add_dep(env, path);
+    l->dl = dir_lookup(path);
+    return vm_loop_next(env, l) ? l : NULL;
+}
+
+int
+rt_loop_next(void *env, void *loop)
+{
+    return vm_loop_next(env, loop);
+}
+
+struct vm_loop *
+rt_loop(struct lacy_env *env, int slot)
+{
+    struct vm_loop *l = arena_alloc(env->arena, sizeof(struct vm_loop));
+    memset(l, 0, sizeof(struct vm_loop));
+    l->slot = slot;
+    return l;
+}
+
+/* splice the template of the next page on the stack */
+void
+write_content(struct ut_str *out, struct lacy_env *env)
+{
+    if (env_has_next(env)) {
+        env_inc(env);
+        do_write_tree(out, env, page_tree(env_get_page(env)));
+        env_dec(env);
+    }
+}
+
+void 
+do_write_tree(struct ut_str *out, struct lacy_env *env, struct tree_node *top)
+{
+    struct tree_node *t;
+    for (t = top; END != t->token; ++t) {
+        switch (t->token) {
+        case BLOCK:
+            str_append_mem(out, t->buffer, t->len);
+            break;
+        case INCLUDE:
+            t = write_include(out, t, env);
+            break;
+        case CONTENT:
+            write_content(out, env);
+            break;
+        case IDENT:
+            t = write_var(out, t, env);
+            break;
+        case FOR:
+            t = write_for(out, t, env);
+            break;
+        case DONE:
+            return;
+        case SH_BLOCK:
+            write_sh_block(out, t, env);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+struct tree_node * 
+write_include(struct ut_str *out, struct tree_node *t, struct lacy_env *env)
+{
+    env_add_dep(env, t->page->src_path);
+    do_write_tree(out, env, page_tree(t->page));
+    return t;
+}
+
+struct tree_node * 
+write_var(struct ut_str *out, struct tree_node *t, struct lacy_env *env)
+{
+    if (SYM_ROOT == t->slot) {
+        write_depth(out, env);
+    }
+    else if (SYM_THIS == t->slot) {
+        struct page *p = env_get_page_top(env);
+        if (NULL != p) {
+            if (NULL != t->link) {
+                t = write_member(out, t->link, p, env);
+            }
+            else {
+                str_append_str(out, p->file_path);
+            }
+        }
+    }
+    else {
+        if (env_inherits(env)) {
+            if (NULL != t->link) {
+                write_var_member(out, env, t->slot, t->link->slot);
+                t = t->link;
+            }
+            else 
+            {
+                char *a = env_attr_lookup(env, t->slot);
+                if (NULL != a) {
+                    str_append_str(out, a);
+                }
+            }
+        }
+    }
+    return t;
+}
+
+struct tree_node *
+write_member(struct ut_str *out, struct tree_node *t, 
+             struct page *p, struct lacy_env *env) 
+{
+    write_attr(out, p, t->slot, env);
+    return t;
+}
+
+void
+write_attr(struct ut_str *out, struct page *p, int slot, 
+           struct lacy_env *env)
+{
+    struct page_attr *pa;
+    /* the attribute does not exist in page */
+    if (NULL == p) 
+        return;
+
+    env_add_dep(env, p->src_path);
+    pa = page_attr_lookup(p, slot);
+    /* the page has the member */
+    if (NULL != pa) 
+        str_append_str(out, pa->value);
+}
+
+/* member of a variable, a directory entry or the page it names */
+void
+write_var_member(struct ut_str *out, struct lacy_env *env, 
+                 int slot, int member)
+{
+    char num[32];
+    char *a = env_attr_lookup(env, slot);
+    struct page *p;
+    struct dir_entry *de = env_entry_lookup(env, slot);
+
+    /* the listing only depends on the names, these on the file */
+    if (NULL != de && SYM_SIZE == member) {
+        env_add_dep(env, de->path);
+        snprintf(num, sizeof(num), "%lld", de->size);
+        str_append_str(out, num);
+    }
+    else if (NULL != de && SYM_MTIME == member) {
+        env_add_dep(env, de->path);
+        snprintf(num, sizeof(num), "%lld", de->mtime);
+        str_append_str(out, num);
+    }
+    else if (NULL != a) {
+        if (NULL != (p = page_load(a))) {
+            write_attr(out, p, member, env);
+        }
+        else {
+            /* rendered again once it shows up */
+            env_add_dep(env, a);
+            if (0 == env->err->len) {
+                str_append_str(env->err, "Unable to open: ");
+                str_append_str(env->err, a);
+                str_append(env->err, '\n');
+            }
+        }
+    }
+}
+
+void 
+write_sh_block(struct ut_str *out, struct tree_node *t, struct lacy_env *env)
+{
+    struct sh_result *r = sh_exec(t->buffer);
+    str_append_mem(out, r->out, r->len);
+}
+
+struct tree_node *
+write_for(struct ut_str *out, struct tree_node *t, struct lacy_env *env)
+{
+    int i;
+    struct tree_node *var, *list, *done;
+    struct dir_list *dl;
+
+    done = t->link;
+    /* Pop var IDENT */
+    var = ++t;
+    /* Pop var list IDENT */
+    list = ++t;
+    ++t;
+
+    if (list->token == SH_BLOCK) {
+        size_t j;
+        char c;
+        struct ut_str file_path;
+        struct sh_result *r = sh_exec(list->buffer);
+        str_init(&file_path);
+
+        for (j = 0; j < r->len; ++j) {
+            c = r->out[j];
+            if (!iswhitespace(c)) {
+                str_append(&file_path, c);
+            }
+            else {
+                if (!str_is_empty(&file_path)) {
+                    env_set(env, var->slot, file_path.s);
+                    do_write_tree(out, env, t);
+
+                    str_clear(&file_path);
+                }
+            }
+        }
+        str_free(&file_path);
+    }
+    else {
+        /* the listing changes whenever the directory mtime does */
+        env_add_dep(env, list->buffer);
+
+        dl = dir_lookup(list->buffer);
+        for (i = 0; i < dl->n; ++i) {
+            env_set_entry(env, var->slot, &dl->entries[i]);
+            do_write_tree(out, env, t);
+        }
+    }
+
+    return done;
+}
+
+/* 
+ * Output of cmd. Each distinct command runs once per build, a block
+ * that needs a command already running waits for its output.
+ */
+struct sh_result *
+sh_exec(const char *cmd)
+{
+    struct sh_result *r;
+    struct ut_str out, key;
+
+    pthread_mutex_lock(&sh_lock);
+    if (NULL != (r = map_get(&sh_memo, cmd))) {
+        /* waiting for a block started elsewhere is shell time as well */
+        if (!r->done) {
+            phase_begin(PH_SHELL, cmd);
+            while (!r->done)
+                pthread_cond_wait(&sh_done, &sh_lock);
+            phase_end();
+        }
+        pthread_mutex_unlock(&sh_lock);
+        return r;
+    }
+    r = calloc(1, sizeof(struct sh_result));
+    map_put(&sh_memo, cmd, r);
+    pthread_mutex_unlock(&sh_lock);
+
+    str_init(&out);
+    str_init(&key);
+    if (sh_cache) 
+        sh_cache_key(cmd, &key);
+
+    if (!sh_cache || !cache_read("sh", key.s, key.len, &out)) {
+        sh_run(cmd, &out);
+        if (sh_cache)
+            cache_write("sh", key.s, key.len, out.s, out.len);
+    }
+    str_free(&key);
+
+    pthread_mutex_lock(&sh_lock);
+    r->len = out.len;
+    r->out = malloc(out.len + 1);
+    memcpy(r->out, out.s, out.len + 1);
+    r->done = true;
+    pthread_cond_broadcast(&sh_done);
+    pthread_mutex_unlock(&sh_lock);
+
+    str_free(&out);
+    return r;
+}
+
+/* 
+ * Start the shell blocks the render is sure to reach on the shell pool,
+ * the writer then picks up each output from the memo in document order.
+ * Blocks may have side effects, so one in a loop body, after a stray
+ * done or in a page that is never spliced in must not run early.
+ */
+void
+sh_prefetch(struct lacy_env *env)
+{
+    int i;
+
+    if (sh_jobs < 2)
+        return;
+    /* each page is spliced in by the content of the layout above it */
+    for (i = 0; i < env->p_stack->size; ++i) {
+        if (!sh_prefetch_tree(page_tree(env->p_stack->stack[i])))
+            break;
+    }
+}
+
+/* queue the blocks t always runs, returns whether it reaches content */
+bool
+sh_prefetch_tree(struct tree_node *t)
+{
+    bool content = false;
+
+    for (; END != t->token && DONE != t->token; ++t) {
+        if (FOR == t->token) {
+            /* the list is run once, the body maybe never */
+            if (END != t[1].token && SH_BLOCK == t[2].token)
+                sh_prefetch_cmd(t[2].buffer);
+            t = t->link;
+        }
+        else if (INCLUDE == t->token) {
+            sh_prefetch_tree(page_tree(t->page));
+        }
+        else if (CONTENT == t->token) {
+            content = true;
+        }
+        else if (SH_BLOCK == t->token) {
+            sh_prefetch_cmd(t->buffer);
+        }
+    }
+    return content;
+}
+
+void
+sh_prefetch_cmd(char *cmd)
+{
+    bool queued;
+
+    pthread_mutex_lock(&sh_lock);
+    queued = NULL != map_get(&sh_memo, cmd);
+    pthread_mutex_unlock(&sh_lock);
+    if (!queued)
+        pool_submit(&sh_pool, sh_prefetch_job, cmd);
+}
+
+void
+sh_prefetch_job(void *arg)
+{
+    sh_exec(arg);
+}
+
+void
+sh_run(const char *cmd, struct ut_str *out)
+{
+    size_t n;
+    char buf[BUFSIZ];
+    FILE *f;
+
+    phase_begin(PH_SHELL, cmd);
+    __atomic_add_fetch(&stats_shells, 1, __ATOMIC_RELAXED);
+    if (sh_coproc) {
+        coproc_run(cmd, out);
+    }
+    else if (NULL == (f = popen(cmd, "r"))) {
+        warn("Unable to run: %s\n", cmd);
+    }
+    else {
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) 
+            str_append_mem(out, buf, n);
+        pclose(f);
+    }
+    phase_end();
+}
+
+/* 
+ * The cache key is the command text followed by the stamp of every
+ * file named after a "# lacy-inputs:" comment in the command.
+ */
+void
+sh_cache_key(const char *cmd, struct ut_str *key)
+{
+    const char *s, *e;
+    struct dep_stamp ds;
+    struct ut_str path;
+    char stamp[64];
+
+    str_append_str(key, cmd);
+    if (NULL == (s = strstr(cmd, SH_INPUTS)))
+        return;
+
+    str_init(&path);
+    s += strlen(SH_INPUTS);
+    while (*s != '\0' && !isnewline(*s)) {
+        while (' ' == *s || '\t' == *s)
+            s++;
+        for (e = s; *e != '\0' && !iswhitespace(*e) && '\t' != *e; ++e)
+            ;
+        if (e == s)
+            break;
+
+        str_clear(&path);
+        str_append_mem(&path, s, e - s);
+        dep_stamp_read(path.s, &ds);
+        snprintf(stamp, sizeof(stamp), "\n%lld %ld %lld ", 
+                ds.mtime_sec, ds.mtime_nsec, ds.size);
+        str_append_str(key, stamp);
+        str_append_str(key, path.s);
+        s = e;
+    }
+    str_free(&path);
+}
+
+/* cache files hold the key length, the key and then the output */
+bool
+cache_read(const char *kind, const char *key, size_t klen, 
+           struct ut_str *out)
+{
+    FILE *f;
+    size_t n, stored_len;
+    bool hit = false;
+    char buf[BUFSIZ];
+    struct ut_str path, stored;
+
+    str_init(&path);
+    str_init(&stored);
+    if (!cache_path(kind, hash_mem(key, klen), &path) 
+     || NULL == (f = fopen(path.s, "r"))) {
+        str_free(&path);
+        return false;
+    }
+    if (1 == fscanf(f, "%zu", &stored_len) && stored_len == klen
+     && '\n' == fgetc(f)) {
+        while (stored.len < klen 
+            && (n = fread(buf, 1, klen - stored.len < sizeof(buf) 
+                          ? klen - stored.len : sizeof(buf), f)) > 0)
+            str_append_mem(&stored, buf, n);
+
+        if (stored.len == klen && 0 == memcmp(stored.s, key, klen)) {
+            while ((n = fread(buf, 1, sizeof(buf), f)) > 0) 
+                str_append_mem(out, buf, n);
+            hit = true;
+        }
+    }
+    fclose(f);
+    str_free(&stored);
+    str_free(&path);
+
+    return hit;
+}
+
+void
+cache_write(const char *kind, const char *key, size_t klen, 
+            const char *s, size_t len)
+{
+    char head[32];
+    struct ut_str path, data;
+
+    str_init(&path);
+    str_init(&data);
+    if (cache_path(kind, hash_mem(key, klen), &path)) {
+        snprintf(head, sizeof(head), "%zu\n", klen);
+        str_append_str(&data, head);
+        str_append_mem(&data, key, klen);
+        str_append_mem(&data, s, len);
+        write_file_atomic(path.s, data.s, data.len);
+    }
+    str_free(&data);
+    str_free(&path);
+}
+
+/* 
+ * Run cmd on a coprocess. The command is quoted and evaluated in a 
+ * subshell so syntax errors, exit and cd stay contained, then a line
+ * unique to this request marks the end of its output.
+ */
+void
+coproc_run(const char *cmd, struct ut_str *out)
+{
+    int attempt;
+    ssize_t n;
+    char buf[BUFSIZ];
+    char delim[64];
+    const char *c;
+    struct ut_str req;
+    struct coproc *cp;
+
+    for (attempt = 0; attempt < 2; ++attempt) {
+        size_t dlen, start = out->len;
+        bool ok = true;
+
+        if (NULL == (cp = coproc_get())) {
+            warn("Unable to start %s\n", conf.shell.s);
+            return;
+        }
+        snprintf(delim, sizeof(delim), "\n__lacy_%d_%lu__\n", 
+                (int)getpid(), cp->seq++);
+        dlen = strlen(delim);
+
+        str_init(&req);
+        str_append_str(&req, "( eval '");
+        for (c = cmd; *c != '\0'; ++c) {
+            if ('\'' == *c)
+                str_append_str(&req, "'\\''");
+            else
+                str_append(&req, *c);
+        }
+        str_append_str(&req, "' ) </dev/null\nprintf '%s' '");
+        str_append_str(&req, delim);
+        str_append_str(&req, "'\n");
+
+        for (c = req.s; ok && c < req.s + req.len; c += n) {
+            if ((n = write(cp->in, c, req.s + req.len - c)) <= 0) 
+                ok = false;
+        }
+        str_free(&req);
+
+        while (ok) {
+            if ((n = read(cp->out, buf, sizeof(buf))) <= 0) {
+                ok = false;
+                break;
+            }
+            str_append_mem(out, buf, n);
+            if (out->len - start >= dlen 
+             && 0 == memcmp(out->s + out->len - dlen, delim, dlen)) {
+                out->len -= dlen;
+                out->s[out->len] = '\0';
+                break;
+            }
+        }
+        if (ok) {
+            coproc_put(cp);
+            return;
+        }
+
+        /* the shell went away, start a new one and try once more */
+        coproc_kill(cp);
+        out->len = start;
+        out->s[out->len] = '\0';
+    }
+    warn("Unable to run: %s\n", cmd);
+}
+
+/* 
+ * An idle coprocess, started when all are busy and the limit allows. An
+ * idle entry whose shell died, or never started, is started again.
+ */
+struct coproc *
+coproc_get()
+{
+    struct coproc *cp;
+
+    pthread_mutex_lock(&coproc_lock);
+    while (true) {
+        for (cp = coproc_list; NULL != cp; cp = cp->next) {
+            if (!cp->busy)
+                break;
+        }
+        if (NULL != cp || coproc_count < coproc_max)
+            break;
+        pthread_cond_wait(&coproc_free, &coproc_lock);
+    }
+    if (NULL == cp) {
+        cp = calloc(1, sizeof(struct coproc));
+        cp->next = coproc_list;
+        coproc_list = cp;
+        coproc_count++;
+    }
+    cp->busy = true;
+    pthread_mutex_unlock(&coproc_lock);
+
+    if (cp->pid <= 0 && !coproc_spawn(cp)) {
+        coproc_put(cp);
+        return NULL;
+    }
+    return cp;
+}
+
+void
+coproc_put(struct coproc *cp)
+{
+    pthread_mutex_lock(&coproc_lock);
+    cp->busy = false;
+    pthread_cond_signal(&coproc_free);
+    pthread_mutex_unlock(&coproc_lock);
+}
+
+bool
+coproc_spawn(struct coproc *cp)
+{
+    int in[2], out[2];
+
+    if (0 != pipe2(in, O_CLOEXEC))
+        return false;
+    if (0 != pipe2(out, O_CLOEXEC)) {
+        close(in[0]);
+        close(in[1]);
+        return false;
+    }
+
+    if (0 == (cp->pid = fork())) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        execl(conf.shell.s, conf.shell.s, (char *)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    if (cp->pid < 0) {
+        close(in[1]);
+        close(out[0]);
+        return false;
+    }
+    cp->in = in[1];
+    cp->out = out[0];
+
+    return true;
+}
+
+/* reap a coprocess, it is started again by the next coproc_get() */
+void
+coproc_kill(struct coproc *cp)
+{
+    if (cp->pid > 0) {
+        close(cp->in);
+        close(cp->out);
+        kill(cp->pid, SIGTERM);
+        waitpid(cp->pid, NULL, 0);
+    }
+    cp->pid = 0;
+    coproc_put(cp);
+}
+
+void
+coproc_free_all()
+{
+    struct coproc *tmp, *cp = coproc_list;
+    while (NULL != cp) {
+        tmp = cp->next;
+        if (cp->pid > 0) {
+            /* end of input makes the shell exit */
+            close(cp->in);
+            close(cp->out);
+            waitpid(cp->pid, NULL, 0);
+        }
+        free(cp);
+        cp = tmp;
+    }
+    coproc_list = NULL;
+    coproc_count = 0;
+}
+
+void
+sh_result_free(void *v)
+{
+    struct sh_result *r = v;
+    free(r->out);
+    free(r);
+}
+
+/* path of a cache entry, creating the cache directories on the way */
+bool
+cache_path(const char *kind, uint64_t hash, struct ut_str *path)
+{
+    char name[32];
+
+    /* next to _output, not in it, so it is never published */
+    str_append_str(path, CACHE_DIR);
+    if (0 != mkdir(path->s, 0777) && EEXIST != errno)
+        return false;
+
+    str_append(path, '/');
+    str_append_str(path, kind);
+    if (0 != mkdir(path->s, 0777) && EEXIST != errno)
+        return false;
+
+    snprintf(name, sizeof(name), "/%016llx", (unsigned long long)hash);
+    str_append_str(path, name);
+    return true;
+}
+
+/* replace path with the given contents so readers never see a partial file */
+bool
+write_file_atomic(const char *path, const char *s, size_t len)
+{
+    int fd;
+    ssize_t n;
+    bool ok;
+    struct ut_str tmp;
+
+    str_init(&tmp);
+    str_append_str(&tmp, path);
+    str_append_str(&tmp, ".XXXXXX");
+    if (-1 == (fd = mkstemp(tmp.s))) {
+        warn("Unable to write %s\n", path);
+        str_free(&tmp);
+        return false;
+    }
+    /* mkstemp creates the file 0600 */
+    fchmod(fd, file_mode);
+    while (len > 0 && (n = write(fd, s, len)) > 0) {
+        s += n;
+        len -= n;
+    }
+    ok = 0 == close(fd) && 0 == len && 0 == rename(tmp.s, path);
+    if (!ok) {
+        warn("Unable to write %s\n", path);
+        unlink(tmp.s);
+    }
+    str_free(&tmp);
+    return ok;
+}
+
+/* whether path holds exactly the len bytes at s */
+bool
+file_same(const char *path, const char *s, size_t len)
+{
+    int fd;
+    ssize_t n;
+    bool same;
+    struct stat st;
+    char buf[BUFSIZ];
+
+    if (-1 == (fd = open(path, O_RDONLY | O_CLOEXEC)))
+        return false;
+    same = 0 == fstat(fd, &st) && S_ISREG(st.st_mode) 
+        && (size_t)st.st_size == len;
+    while (same && (n = read(fd, buf, sizeof(buf))) > 0) {
+        if ((size_t)n > len || 0 != memcmp(buf, s, n)) 
+            same = false;
+        s += n;
+        len -= n;
+    }
+    close(fd);
+
+    return same && 0 == len;
+}
+
+void
+write_depth(struct ut_str *out, struct lacy_env *env)
+{
+    int d;
+    if (env->depth > 0) {
+        for (d = 1; d < env->depth; ++d) {
+            str_append_str(out, "../");
+        }
+        str_append_str(out, "..");
+    }
+    else {
+        str_append(out, '.');
+    }
+}
+
+char * 
+env_attr_lookup(struct lacy_env *env, int slot)
+{
+    if (slot < env->nvars) 
+        return env->vars[slot].value;
+
+    return NULL;
+}
+
+struct dir_entry *
+env_entry_lookup(struct lacy_env *env, int slot)
+{
+    if (slot < env->nvars) 
+        return env->vars[slot].entry;
+
+    return NULL;
+}
+
+void
+env_add_dep(struct lacy_env *env, const char *path)
+{
+    if (NULL == map_get(&env->deps, path))
+        map_put(&env->deps, path, (void *)path);
+}
+
+void
+dep_stamp_read(const char *path, struct dep_stamp *ds)
+{
+    struct stat st;
+    if (0 != stat(path, &st)) {
+        ds->mtime_sec = 0;
+        ds->mtime_nsec = 0;
+        ds->size = -1;
+        return;
+    }
+    ds->mtime_sec = st.st_mtim.tv_sec;
+    ds->mtime_nsec = st.st_mtim.tv_nsec;
+    ds->size = st.st_size;
+}
+
+/* true when the last build of src_path is still current */
+bool
+deps_fresh(const char *src_path)
+{
+    int i;
+    struct stat st;
+    struct dep_entry *e;
+    struct ut_str key;
+
+    if (always_make)
+        return false;
+    /* the page may be named differently than when it was recorded */
+    str_init(&key);
+    page_path_key(src_path, &key);
+    e = map_get(&deps_prev, key.s);
+    str_free(&key);
+    if (NULL == e)
+        return false;
+
+    if (0 != stat(e->out, &st))
+        return false;
+
+    for (i = 0; i < e->ndeps; ++i) {
+        if (dep_stamp_changed(&e->deps[i]))
+            return false;
+    }
+    return true;
+}
+
+bool
+dep_stamp_changed(struct dep_stamp *ds)
+{
+    struct dep_stamp now;
+    dep_stamp_read(ds->path, &now);
+    return now.size != ds->size || now.mtime_sec != ds->mtime_sec
+        || now.mtime_nsec != ds->mtime_nsec;
+}
+
+/* stamps of everything env read */
+struct dep_entry *
+dep_entry_new(const char *out, struct lacy_env *env)
+{
+    size_t i;
+    int n = 0;
+    struct dep_entry *e = malloc(sizeof(struct dep_entry));
+
+    e->out = strdup(out);
+    e->ndeps = env->deps.size;
+    e->deps = calloc(e->ndeps, sizeof(struct dep_stamp));
+    for (i = 0; i < env->deps.cap; ++i) {
+        if (NULL == env->deps.slots[i].key)
+            continue;
+
+        e->deps[n].path = strdup(env->deps.slots[i].key);
+        dep_stamp_read(e->deps[n].path, &e->deps[n]);
+        n++;
+    }
+    return e;
+}
+
+void
+deps_record(const char *src_path, struct dep_entry *e)
+{
+    struct ut_str key;
+
+    str_init(&key);
+    page_path_key(src_path, &key);
+    pthread_mutex_lock(&deps_lock);
+    dep_entry_free(map_get(&deps_next, key.s));
+    map_put(&deps_next, key.s, e);
+    pthread_mutex_unlock(&deps_lock);
+    str_free(&key);
+}
+
+void
+deps_load()
+{
+    FILE *f;
+    char *line = NULL;
+    size_t n = 0;
+    ssize_t len;
+    int off;
+    struct dep_entry *e = NULL;
+    struct dep_stamp ds;
+    struct ut_str path, key;
+
+    map_init(&deps_prev);
+    map_init(&deps_next);
+
+    str_init(&path);
+    str_init(&key);
+    str_append_str(&path, conf.output_dir.s);
+    str_append(&path, '/');
+    str_append_str(&path, DEPS_FILE);
+
+    if (NULL == (f = fopen(path.s, "r"))) {
+        str_free(&key);
+        str_free(&path);
+        return;
+    }
+
+    len = getline(&line, &n, f);
+    if (len <= 0 || 0 != strncmp(line, DEPS_MAGIC "\n", len)) 
+        goto done;
+
+    while ((len = getline(&line, &n, f)) > 0) {
+        if ('\n' == line[len - 1])
+            line[len - 1] = '\0';
+
+        if (0 == strncmp(line, "page ", 5)) {
+            e = calloc(1, sizeof(struct dep_entry));
+            e->out = strdup("");
+            str_clear(&key);
+            page_path_key(line + 5, &key);
+            dep_entry_free(map_get(&deps_prev, key.s));
+            map_put(&deps_prev, key.s, e);
+        }
+        else if (NULL == e) {
+            continue;
+        }
+        else if (0 == strncmp(line, "out ", 4)) {
+            free(e->out);
+            e->out = strdup(line + 4);
+        }
+        else if (3 == sscanf(line, "dep %lld %ld %lld %n", &ds.mtime_sec, 
+                    &ds.mtime_nsec, &ds.size, &off)) {
+            ds.path = strdup(line + off);
+            e->deps = realloc(e->deps, 
+                    (e->ndeps + 1) * sizeof(struct dep_stamp));
+            e->deps[e->ndeps++] = ds;
+        }
+    }
+
+done:
+    free(line);
+    fclose(f);
+    str_free(&key);
+    str_free(&path);
+}
+
+/* write deps_next merged with entries of pages not rendered this run */
+void
+deps_save()
+{
+    FILE *f;
+    int i;
+    size_t j;
+    struct hash_map *maps[2] = { &deps_next, &deps_prev };
+    struct ut_str path, tmp;
+
+    str_init(&path);
+    str_append_str(&path, conf.output_dir.s);
+    str_append(&path, '/');
+    str_append_str(&path, DEPS_FILE);
+    str_init(&tmp);
+    str_append_str(&tmp, path.s);
+    str_append_str(&tmp, ".tmp");
+
+    if (NULL == (f = fopen(tmp.s, "w"))) {
+        warn("Unable to write %s\n", tmp.s);
+        goto done;
+    }
+    fprintf(f, DEPS_MAGIC "\n");
+    for (i = 0; i < 2; ++i) {
+        for (j = 0; j < maps[i]->cap; ++j) {
+            struct hash_slot *hs = &maps[i]->slots[j];
+            struct dep_entry *e = hs->value;
+            int k;
+
+            if (NULL == hs->key)
+                continue;
+            if (maps[i] == &deps_prev && NULL != map_get(&deps_next, hs->key))
+                continue;
+
+            fprintf(f, "page %s\nout %s\n", hs->key, e->out);
+            for (k = 0; k < e->ndeps; ++k) {
+                fprintf(f, "dep %lld %ld %lld %s\n", e->deps[k].mtime_sec,
+                        e->deps[k].mtime_nsec, e->deps[k].size, 
+                        e->deps[k].path);
+            }
+        }
+    }
+    if (0 != fclose(f) || 0 != rename(tmp.s, path.s))
+        warn("Unable to write %s\n", path.s);
+
+done:
+    map_free(&deps_prev, dep_entry_free);
+    map_free(&deps_next, dep_entry_free);
+    str_free(&tmp);
+    str_free(&path);
+}
+
+void
+dep_entry_free(void *v)
+{
+    int i;
+    struct dep_entry *e = v;
+    if (NULL == e)
+        return;
+
+    for (i = 0; i < e->ndeps; ++i) 
+        free(e->deps[i].path);
+    free(e->deps);
+    free(e->out);
+    free(e);
+}
+
+void 
+usage()
+{
+printf("Usage: " PACKAGE_NAME " [OPTION]... [FILE]... \n\
+  -B, --always-make  Render all pages, even when they are up to date\n\
+  -h, --help         Show usage information\n\
+  -j, --jobs=N       Render N pages in parallel\n\
+      --link         Hard link static files instead of copying them\n\
+      --symlink      Symlink static directories, hard link files\n\
+      --sh-cache     Keep shell block output between runs\n\
+      --coproc       Run shell blocks on persistent shells, one per job\n\
+      --sh-jobs=N    Run up to N shell blocks at once (default 4)\n\
+      --engine=NAME  Run templates on the bytecode \"vm\" (default) or\n\
+                     walk the \"tree\"\n\
+      --native       Compile layouts to native code with $CC\n\
+      --watch        Render again whenever an input changes\n\
+      --serve=PORT   Serve the site on localhost, rendering pages on\n\
+                     request instead of writing _output\n\
+      --stats[=N]    Print the time spent in each phase of the build and\n\
+                     the N slowest pages (default 10)\n\
+      --trace=FILE   Write a Chrome trace of the build to FILE\n\
+  -q, --quiet        Supress all output\n\
+  -v, --verbose      Increase verbosity\n\
+  -V, --version      Print version\n\
+");
+    exit(EXIT_SUCCESS);
+}
+
+void 
+version()
+{
+    printf(PACKAGE_NAME " version " PACKAGE_VERSION " (" PACKAGE_URL ") \n");
+    exit(EXIT_SUCCESS);
+}
+
+
+/* make room for ns more bytes and the terminator */
+void 
+str_resize(struct ut_str *u, size_t ns)
+{
+    size_t size;
+    if (u->len + ns < u->size) 
+        return;
+
+    size = u->size * 2;
+    if (size <= u->len + ns)
+        size = u->len + ns + 1;
+
+    if (u->s == u->buf) {
+        u->s = malloc(size);
+        memcpy(u->s, u->buf, u->len + 1);
+    }
+    else {
+        u->s = realloc(u->s, size);
+    }
+    u->size = size;
+}
+
+void
+str_init(struct ut_str *u)
+{
+    u->len = 0;
+    u->size = STR_INLINE;
+    u->s = u->buf;
+    u->buf[0] = '\0';
+}
+
+void
+str_append(struct ut_str *u, char c) 
+{
+    str_resize(u, 1);
+    u->s[u->len] = c;
+    u->len++;
+    u->s[u->len] = '\0';
+}
+
+void
+str_append_str(struct ut_str *u, const char *s) 
+{
+    str_append_mem(u, s, strlen(s));
+}
+
+void
+str_append_mem(struct ut_str *u, const char *s, size_t n) 
+{
+    str_resize(u, n);
+    memcpy(u->s + u->len, s, n);
+    u->len += n;
+    u->s[u->len] = '\0';
+}
+
+/* strips leading whitespace and a single trailing whitespace character */
+void 
+str_trim(struct ut_str *u)
+{
+    size_t start = 0;
+    while (start < u->len && iswhitespace(u->s[start]))
+        start++;
+
+    u->len -= start;
+    memmove(u->s, u->s + start, u->len + 1);
+    if (u->len > 0 && iswhitespace(u->s[u->len - 1])) 
+        u->s[--u->len] = '\0';
+}
+
+int 
+iswhitespace(char c)
+{
+    return c == ' ' || isnewline(c);
+}
+
+int
+isnewline(char c)
+{
+    return c == '\n' || c == '\r';
+}
+
+int
+str_is_empty(struct ut_str *u)
+{
+    if (u->len <= 0)
+        return 1;
+
+    return 0;
+}
+
+void
+str_clear(struct ut_str *u)
+{
+    u->len = 0;
+    u->s[0] = '\0';
+}
+
+void
+str_free(struct ut_str *u)
+{
+    if (NULL != u->s && u->buf != u->s) 
+        free(u->s);
+    u->s = NULL;
+}
+
+void
+arena_init(struct arena *a, size_t block_size)
+{
+    a->head = NULL;
+    a->cur = NULL;
+    a->block_size = block_size;
+}
+
+void *
+arena_alloc(struct arena *a, size_t n)
+{
+    struct arena_block *b;
+    size_t size;
+
+    n = (n + 15) & ~(size_t)15;
+    while (NULL != a->cur && a->cur->used + n > a->cur->size) {
+        if (NULL == a->cur->next)
+            break;
+        a->cur = a->cur->next;
+    }
+    if (NULL == a->cur || a->cur->used + n > a->cur->size) {
+        /* blocks grow so pages with large templates need few of them */
+        size = a->block_size;
+        if (a->block_size < ARENA_MAX)
+            a->block_size *= 2;
+        if (size < n)
+            size = n;
+
+        b = malloc(sizeof(struct arena_block) + size);
+        b->size = size;
+        b->used = 0;
+        b->next = NULL;
+        if (NULL == a->cur) 
+            a->head = b;
+        else
+            a->cur->next = b;
+        a->cur = b;
+    }
+    b = a->cur;
+    b->used += n;
+
+    return b->data + b->used - n;
+}
+
+char *
+arena_strdup(struct arena *a, const char *s)
+{
+    size_t n = strlen(s) + 1;
+    return memcpy(arena_alloc(a, n), s, n);
+}
+
+char *
+arena_strndup(struct arena *a, const char *s, size_t n)
+{
+    char *d = memcpy(arena_alloc(a, n + 1), s, n);
+    d[n] = '\0';
+    return d;
+}
+
+/* release all allocations but keep the blocks for reuse */
+void
+arena_reset(struct arena *a)
+{
+    struct arena_block *b;
+    for (b = a->head; NULL != b; b = b->next)
+        b->used = 0;
+    a->cur = a->head;
+}
+
+/* move the blocks of from to the end of a, from is left empty */
+void
+arena_adopt(struct arena *a, struct arena *from)
+{
+    struct arena_block *b = a->cur;
+
+    if (NULL == from->head)
+        return;
+    if (NULL == b) {
+        a->head = from->head;
+        a->cur = from->cur;
+    }
+    else {
+        while (NULL != b->next)
+            b = b->next;
+        b->next = from->head;
+    }
+    from->head = NULL;
+    from->cur = NULL;
+}
+
+void
+arena_free(struct arena *a)
+{
+    struct arena_block *tmp, *b = a->head;
+    while (NULL != b) {
+        tmp = b->next;
+        free(b);
+        b = tmp;
+    }
+    a->head = NULL;
+    a->cur = NULL;
+}
+
+/* FNV-1a */
+uint64_t
+hash_str(const char *s)
+{
+    return hash_mem(s, strlen(s));
+}
+
+uint64_t
+hash_mem(const char *s, size_t n)
+{
+    uint64_t h = 14695981039346656037ULL;
+    while (n-- > 0) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+void
+map_init(struct hash_map *m)
+{
+    m->cap = 0;
+    m->size = 0;
+    m->slots = NULL;
+}
+
+void *
+map_get(struct hash_map *m, const char *key)
+{
+    size_t i;
+    uint64_t h;
+
+    if (0 == m->size)
+        return NULL;
+
+    h = hash_str(key);
+    for (i = h & (m->cap - 1); NULL != m->slots[i].key; 
+         i = (i + 1) & (m->cap - 1)) {
+        if (h == m->slots[i].hash && 0 == strcmp(m->slots[i].key, key))
+            return m->slots[i].value;
+    }
+    return NULL;
+}
+
+/* insert or replace, the key is copied */
+void
+map_put(struct hash_map *m, const char *key, void *value)
+{
+    size_t i;
+    uint64_t h;
+
+    if ((m->size + 1) * 4 > m->cap * 3)
+        map_grow(m);
+
+    h = hash_str(key);
+    for (i = h & (m->cap - 1); NULL != m->slots[i].key; 
+         i = (i + 1) & (m->cap - 1)) {
+        if (h == m->slots[i].hash && 0 == strcmp(m->slots[i].key, key)) {
+            m->slots[i].value = value;
+            return;
+        }
+    }
+    m->slots[i].key = strdup(key);
+    m->slots[i].hash = h;
+    m->slots[i].value = value;
+    m->size++;
+}
+
+void
+map_grow(struct hash_map *m)
+{
+    size_t i, j;
+    size_t old_cap = m->cap;
+    struct hash_slot *old = m->slots;
+
+    m->cap = 0 == old_cap ? 16 : old_cap * 2;
+    m->slots = calloc(m->cap, sizeof(struct hash_slot));
+
+    for (i = 0; i < old_cap; ++i) {
+        if (NULL == old[i].key)
+            continue;
+
+        for (j = old[i].hash & (m->cap - 1); NULL != m->slots[j].key; 
+             j = (j + 1) & (m->cap - 1))
+            ;
+        m->slots[j] = old[i];
+    }
+    free(old);
+}
+
+void
+map_free(struct hash_map *m, void (*free_value)(void *))
+{
+    size_t i;
+    for (i = 0; i < m->cap; ++i) {
+        if (NULL == m->slots[i].key)
+            continue;
+
+        free(m->slots[i].key);
+        if (NULL != free_value)
+            free_value(m->slots[i].value);
+    }
+    free(m->slots);
+    map_init(m);
+}
+
+bool
+file_exists(char *s)
+{
+    struct stat st;
+    return 0 == stat(s, &st);
+}
+
+/* listing of path, read on first use and shared for the whole run */
+struct dir_list *
+dir_lookup(const char *path)
+{
+    struct dir_list *dl, *found;
+
+    pthread_mutex_lock(&dir_lock);
+    dl = map_get(&dir_cache, path);
+    pthread_mutex_unlock(&dir_lock);
+    if (NULL != dl)
+        return dl;
+
+    dl = calloc(1, sizeof(struct dir_list));
+    phase_begin(PH_DIRS, path);
+    dir_read(path, dl);
+    phase_end();
+
+    pthread_mutex_lock(&dir_lock);
+    if (NULL != (found = map_get(&dir_cache, path))) {
+        /* another render read it first */
+        dir_list_free(dl);
+        dl = found;
+    }
+    else {
+        map_put(&dir_cache, path, dl);
+    }
+    pthread_mutex_unlock(&dir_lock);
+
+    return dl;
+}
+
+void
+dir_read(const char *path, struct dir_list *dl)
+{
+    int fd, cap = 0;
+    long n, off;
+    char buf[32768];
+    struct stat st;
+    struct lx_dirent64 *d;
+    struct dir_entry *de;
+    struct ut_str entry;
+
+    if (-1 == (fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)))
+        return;
+
+    str_init(&entry);
+    while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (off = 0; off < n; off += d->d_reclen) {
+            d = (struct lx_dirent64 *)(buf + off);
+            if (0 == strcmp(d->d_name, ".") || 0 == strcmp(d->d_name, ".."))
+                continue;
+
+            if (dl->n == cap) {
+                cap = cap ? 2 * cap : 16;
+                dl->entries = realloc(dl->entries, 
+                        cap * sizeof(struct dir_entry));
+            }
+            de = &dl->entries[dl->n++];
+            de->name = strdup(d->d_name);
+            str_clear(&entry);
+            str_append_str(&entry, path);
+            str_append(&entry, '/');
+            str_append_str(&entry, d->d_name);
+            de->path = strdup(entry.s);
+            de->is_dir = DT_DIR == d->d_type;
+            de->size = 0;
+            de->mtime = 0;
+            if (0 == fstatat(fd, d->d_name, &st, 0)) {
+                de->is_dir = S_ISDIR(st.st_mode);
+                de->size = st.st_size;
+                de->mtime = st.st_mtime;
+            }
+        }
+    }
+    close(fd);
+    str_free(&entry);
+
+    qsort(dl->entries, dl->n, sizeof(struct dir_entry), dir_entry_cmp);
+}
+
+int
+dir_entry_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct dir_entry *)a)->name, 
+                  ((const struct dir_entry *)b)->name);
+}
+
+void
+dir_list_free(void *v)
+{
+    int i;
+    struct dir_list *dl = v;
+    for (i = 0; i < dl->n; ++i) {
+        free(dl->entries[i].name);
+        free(dl->entries[i].path);
+    }
+    free(dl->entries);
+    free(dl);
+}
+
+int
+build_depth(char *file_path) 
+{
+    char *s;
+    int depth = 0;
+    struct ut_str buf;
+    str_init(&buf);
 
     s = file_path;
     while (*s != '\0') {
@@ -1221,132 +4163,1451 @@ build_depth(char *file_path)
         str_append(&buf, *s);
         s++;
     }
-    str_free(&buf);
+    str_free(&buf);
+
+    return depth;
+}
+
+/* copy the tree below src into dest on a small pool of threads */
+int
+copy_dir(char *src, char *dest)
+{
+    DIR *d;
+    struct work_pool wp;
+
+    if (NULL == (d = opendir(src))) {
+        return -1;
+    }
+    closedir(d);
+
+    pool_init(&wp, jobs > COPY_THREADS ? jobs : COPY_THREADS);
+    copy_submit(&wp, src, dest, copy_dir_job, true);
+    pool_wait(&wp);
+    pool_free(&wp);
+
+    return 0;
+}
+
+void
+copy_submit(struct work_pool *wp, char *src, char *dest, 
+            void (*fn)(void *), bool top)
+{
+    struct copy_job *cj = malloc(sizeof(struct copy_job));
+    cj->wp = wp;
+    cj->top = top;
+    cj->src = strdup(src);
+    cj->dest = strdup(dest);
+    pool_submit(wp, fn, cj);
+}
+
+/* queue every entry of a directory, subdirectories are walked in turn */
+void
+copy_dir_job(void *arg)
+{
+    DIR *d;
+    struct dirent *de; 
+    struct copy_job *cj = arg;
+
+    if (NULL != (d = opendir(cj->src))) {
+        while ((de = readdir(d)) != NULL) {
+            bool is_dir;
+            struct stat st;
+            struct ut_str u_s, u_d;
+
+            if (strcmp(de->d_name, ".") == 0 
+             || strcmp(de->d_name, "..") == 0)
+                continue;
+
+            str_init(&u_d);
+            str_init(&u_s);
+
+            str_append_str(&u_d, cj->dest);
+            str_append_str(&u_s, cj->src);
+
+            str_append(&u_d, '/');
+            str_append(&u_s, '/');
+
+            str_append_str(&u_d, de->d_name);
+            str_append_str(&u_s, de->d_name);
+
+            if (verbosity > 1)
+                printf("Copying %s\n", u_s.s);
+
+            is_dir = DT_DIR == de->d_type;
+            if (DT_UNKNOWN == de->d_type && 0 == stat(u_s.s, &st))
+                is_dir = S_ISDIR(st.st_mode);
+
+            if (is_dir && STATIC_SYMLINK == static_mode && cj->top
+             && NULL == map_get(&page_dirs, de->d_name)
+             && symlink_dir(u_s.s, u_d.s)) {
+                /* linked as a whole */
+            }
+            else if (is_dir) {
+                if (copy_dest_dir(u_d.s))
+                    copy_submit(cj->wp, u_s.s, u_d.s, copy_dir_job, false);
+            }
+            else {
+                copy_submit(cj->wp, u_s.s, u_d.s, copy_file_job, false);
+            }
+            str_free(&u_s);
+            str_free(&u_d);
+        }
+        closedir(d);
+    }
+    free(cj->src);
+    free(cj->dest);
+    free(cj);
+}
+
+void
+copy_file_job(void *arg)
+{
+    struct copy_job *cj = arg;
+    int ok = STATIC_COPY == static_mode 
+        ? copy_file(cj->src, cj->dest) : link_file(cj->src, cj->dest);
+
+    if (!ok)
+        warn("Unable to copy %s to %s\n", cj->src, cj->dest);
+
+    free(cj->src);
+    free(cj->dest);
+    free(cj);
+}
+
+/* 
+ * dest may be a symlink or hard link into the static dir from a 
+ * previous run, never write through it
+ */
+bool
+copy_dest_dir(char *dest)
+{
+    struct stat st;
+    if (0 == lstat(dest, &st) && S_ISLNK(st.st_mode))
+        unlink(dest);
+
+    if (0 != mkdir(dest, 0777) && EEXIST != errno) {
+        warn("Unable to mkdir %s\n", dest);
+        return false;
+    }
+    return true;
+}
+
+/* hard link src to dest, copy when linking is not possible */
+int
+link_file(char *src, char *dest)
+{
+    struct stat s_st, d_st;
+
+    if (0 == link(src, dest)) 
+        return 1;
+
+    if (EEXIST == errno && 0 == stat(src, &s_st) && 0 == lstat(dest, &d_st) 
+     && s_st.st_ino == d_st.st_ino && s_st.st_dev == d_st.st_dev) 
+        return 1;
+
+    unlink(dest);
+    if (0 == link(src, dest)) 
+        return 1;
+
+    return copy_file(src, dest);
+}
+
+bool
+symlink_dir(char *src, char *dest)
+{
+    char *target;
+    char buf[PATH_MAX];
+    ssize_t n;
+    struct stat st;
+    bool ok = false;
+
+    if (NULL == (target = realpath(src, NULL)))
+        return false;
+
+    if (0 == lstat(dest, &st)) {
+        if (S_ISLNK(st.st_mode) 
+         && (n = readlink(dest, buf, sizeof(buf) - 1)) > 0) {
+            buf[n] = '\0';
+            if (0 == strcmp(buf, target)) {
+                free(target);
+                return true;
+            }
+        }
+        /* a real directory from an earlier copy is walked instead */
+        if (S_ISDIR(st.st_mode) || 0 != unlink(dest)) {
+            free(target);
+            return false;
+        }
+    }
+    ok = 0 == symlink(target, dest);
+    free(target);
+
+    return ok;
+}
+
+int
+copy_file(char *src, char *dest)
+{
+    int sfd, dfd;
+    bool ok;
+    struct stat st;
+
+    if (-1 == (sfd = open(src, O_RDONLY)))
+        return 0;
+
+    /* do not truncate a file linked from the static dir */
+    unlink(dest);
+
+    if (0 != fstat(sfd, &st) 
+     || -1 == (dfd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 
+                          st.st_mode & 0777))) {
+        close(sfd);
+        return 0;
+    }
+
+    ok = copy_fd(sfd, dfd, st.st_size);
+
+    close(sfd);
+    if (0 != close(dfd))
+        ok = false;
+    return ok ? 1 : 0;
+}
+
+/* 
+ * Share the extents when the filesystem can reflink, else let the
+ * kernel copy and only fall back to read/write when it can not.
+ */
+bool
+copy_fd(int sfd, int dfd, off_t size)
+{
+    char buf[BUFSIZ];
+    ssize_t n, w;
+    off_t done = 0;
+
+#ifdef __linux__
+#ifdef FICLONE
+    if (0 == ioctl(dfd, FICLONE, sfd))
+        return true;
+#endif
+    while (done < size 
+        && (n = copy_file_range(sfd, NULL, dfd, NULL, size - done, 0)) > 0)
+        done += n;
+
+    while (done < size && (n = sendfile(dfd, sfd, NULL, size - done)) > 0)
+        done += n;
+
+    if (done >= size)
+        return true;
+#endif
+
+    /* copy whatever is left, the file may also have grown meanwhile */
+    while ((n = read(sfd, buf, sizeof(buf))) > 0) {
+        char *b = buf;
+        while (n > 0) {
+            if ((w = write(dfd, b, n)) < 0) {
+                if (EINTR == errno)
+                    continue;
+                return false;
+            }
+            b += w;
+            n -= w;
+        }
+    }
+    return 0 == n;
+}
+
+void
+warn(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+}
+
+void 
+fatal(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    exit(EXIT_FAILURE);
+}
+
+void
+pool_init(struct work_pool *wp, int nthreads)
+{
+    int i;
+
+    pthread_mutex_init(&wp->lock, NULL);
+    pthread_cond_init(&wp->has_work, NULL);
+    pthread_cond_init(&wp->idle, NULL);
+    wp->head = NULL;
+    wp->tail = NULL;
+    wp->active = 0;
+    wp->stop = false;
+    wp->nthreads = nthreads;
+    wp->threads = calloc(nthreads, sizeof(pthread_t));
+
+    for (i = 0; i < nthreads; ++i) {
+        if (0 != pthread_create(&wp->threads[i], NULL, pool_worker, wp))
+            fatal("Unable to start worker thread\n");
+    }
+}
+
+void
+pool_submit(struct work_pool *wp, void (*fn)(void *), void *arg)
+{
+    struct pool_job *j = malloc(sizeof(struct pool_job));
+    j->fn = fn;
+    j->arg = arg;
+    j->next = NULL;
+
+    pthread_mutex_lock(&wp->lock);
+    if (NULL == wp->tail) {
+        wp->head = j;
+    }
+    else {
+        wp->tail->next = j;
+    }
+    wp->tail = j;
+    pthread_cond_signal(&wp->has_work);
+    pthread_mutex_unlock(&wp->lock);
+}
+
+/* wait until the queue is drained and no job is running */
+void
+pool_wait(struct work_pool *wp)
+{
+    pthread_mutex_lock(&wp->lock);
+    while (NULL != wp->head || wp->active > 0) 
+        pthread_cond_wait(&wp->idle, &wp->lock);
+    pthread_mutex_unlock(&wp->lock);
+}
+
+void
+pool_free(struct work_pool *wp)
+{
+    int i;
+
+    pthread_mutex_lock(&wp->lock);
+    wp->stop = true;
+    pthread_cond_broadcast(&wp->has_work);
+    pthread_mutex_unlock(&wp->lock);
+
+    for (i = 0; i < wp->nthreads; ++i) 
+        pthread_join(wp->threads[i], NULL);
+
+    free(wp->threads);
+    pthread_cond_destroy(&wp->idle);
+    pthread_cond_destroy(&wp->has_work);
+    pthread_mutex_destroy(&wp->lock);
+}
+
+void *
+pool_worker(void *arg)
+{
+    struct pool_job *j;
+    struct work_pool *wp = arg;
+
+    pthread_mutex_lock(&wp->lock);
+    while (true) {
+        while (NULL == wp->head && !wp->stop)
+            pthread_cond_wait(&wp->has_work, &wp->lock);
+
+        if (NULL == wp->head)
+            break;
+
+        j = wp->head;
+        wp->head = j->next;
+        if (NULL == wp->head)
+            wp->tail = NULL;
+        wp->active++;
+        pthread_mutex_unlock(&wp->lock);
+
+        j->fn(j->arg);
+        free(j);
+
+        pthread_mutex_lock(&wp->lock);
+        wp->active--;
+        if (NULL == wp->head && 0 == wp->active) 
+            pthread_cond_broadcast(&wp->idle);
+    }
+    pthread_mutex_unlock(&wp->lock);
+
+    if (NULL != thread_arena) {
+        arena_free(thread_arena);
+        free(thread_arena);
+    }
+    return NULL;
+}
+
+/* scratch memory of the current thread, reused by each render */
+struct arena *
+render_arena()
+{
+    if (NULL == thread_arena) {
+        thread_arena = malloc(sizeof(struct arena));
+        arena_init(thread_arena, ARENA_RENDER);
+    }
+    return thread_arena;
+}
+
+/* 
+ * Load the markdown inputs that will be rendered on a pool first, each
+ * conversion is independent and page_find() caches the result.
+ */
+void
+mkd_prepass(char **paths, int n)
+{
+    int i, todo = 0, threads;
+    char **work;
+    struct work_pool wp;
+
+    work = malloc(n * sizeof(char *));
+    phase_begin(PH_DEPS, NULL);
+    for (i = 0; i < n; ++i) {
+        if (NULL != strstr(paths[i], ".mkd") && !deps_fresh(paths[i]))
+            work[todo++] = paths[i];
+    }
+    phase_end();
+    if (todo > 1) {
+        threads = jobs > 1 ? jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads > todo)
+            threads = todo;
+        if (threads < 1)
+            threads = 1;
+
+        pool_init(&wp, threads);
+        for (i = 0; i < todo; ++i)
+            pool_submit(&wp, mkd_prepass_job, work[i]);
+        pool_wait(&wp);
+        pool_free(&wp);
+    }
+    free(work);
+}
+
+void
+mkd_prepass_job(void *arg)
+{
+    page_find(arg);
+}
+
+void
+render_job(void *arg)
+{
+    bool fresh;
+
+    phase_begin(PH_DEPS, arg);
+    fresh = deps_fresh(arg);
+    phase_end();
+    if (fresh) {
+        if (verbosity > 1)
+            printf("Up to date %s\n", (char *)arg);
+        return;
+    }
+    render(page_find(arg));
+}
 
-    return depth;
+/* run fn on every path, on a pool with more than one job */
+void
+render_pages(char **paths, int n, void (*fn)(void *))
+{
+    int i;
+    struct work_pool wp;
+
+    if (n > 1 && jobs > 1) {
+        pool_init(&wp, jobs);
+        for (i = 0; i < n; ++i) 
+            pool_submit(&wp, fn, paths[i]);
+
+        pool_wait(&wp);
+        pool_free(&wp);
+    }
+    else {
+        for (i = 0; i < n; ++i) 
+            fn(paths[i]);
+    }
 }
 
-int
-copy_dir(char *src, char *dest)
+/* 
+ * Keep the pages loaded and render again whatever a file change reaches.
+ * Directories holding the dependencies of the pages are watched, the 
+ * static dir as a whole. Returns on SIGINT or SIGTERM.
+ */
+void
+watch(char **paths, int n)
+{
+    bool all;
+    struct sigaction sa;
+    struct hash_map changed;
+
+    if (-1 == (watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)))
+        fatal("Unable to watch files: %s\n", strerror(errno));
+    map_init(&watch_dirs);
+
+    /* no SA_RESTART, poll() has to return */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    watch_deps(paths, n);
+    watch_tree(conf.static_dir.s);
+    if (verbosity > 0)
+        printf("Watching for changes, ^C to stop\n");
+    fflush(stdout);
+
+    while (!stop_flag) {
+        map_init(&changed);
+        all = watch_read(&changed);
+        if (!stop_flag && (all || changed.size > 0))
+            watch_cycle(paths, n, &changed, all);
+        map_free(&changed, NULL);
+    }
+
+    close(watch_fd);
+    watch_fd = -1;
+    map_free(&watch_dirs, NULL);
+    for (n = 0; n < watch_nnames; ++n) 
+        free(watch_names[n]);
+    free(watch_names);
+    watch_names = NULL;
+    watch_nnames = 0;
+}
+
+void
+watch_dir(const char *dir)
+{
+    int wd;
+    uint32_t mask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM 
+                  | IN_MOVED_TO | IN_ATTRIB;
+
+    if (NULL != map_get(&watch_dirs, dir))
+        return;
+    if (-1 == (wd = inotify_add_watch(watch_fd, dir, mask | IN_ONLYDIR))) {
+        if (verbosity > 1)
+            warn("Unable to watch %s\n", dir);
+        return;
+    }
+    if (wd >= watch_nnames) {
+        watch_names = realloc(watch_names, (wd + 1) * sizeof(char *));
+        memset(watch_names + watch_nnames, 0, 
+                (wd + 1 - watch_nnames) * sizeof(char *));
+        watch_nnames = wd + 1;
+    }
+    free(watch_names[wd]);
+    watch_names[wd] = strdup(dir);
+    map_put(&watch_dirs, dir, watch_names[wd]);
+}
+
+/* dir and every directory below it */
+void
+watch_tree(const char *dir)
 {
     DIR *d;
-    struct dirent *de; 
-    if (NULL == (d = opendir(src))) {
-        return -1;
+    struct dirent *de;
+    struct stat st;
+    struct ut_str sub;
+
+    if (NULL == (d = opendir(dir)))
+        return;
+    watch_dir(dir);
+
+    str_init(&sub);
+    while (NULL != (de = readdir(d))) {
+        if (0 == strcmp(de->d_name, ".") || 0 == strcmp(de->d_name, ".."))
+            continue;
+
+        str_clear(&sub);
+        str_append_str(&sub, dir);
+        str_append(&sub, '/');
+        str_append_str(&sub, de->d_name);
+        if (DT_DIR == de->d_type 
+         || (DT_UNKNOWN == de->d_type && 0 == lstat(sub.s, &st) 
+          && S_ISDIR(st.st_mode)))
+            watch_tree(sub.s);
     }
+    str_free(&sub);
+    closedir(d);
+}
 
-    while ((de = readdir(d)) != NULL) {
-        if (strcmp(de->d_name, ".") == 0 
-         || strcmp(de->d_name, "..") == 0)
+/* the directory of every page and of everything it was built from */
+void
+watch_deps(char **paths, int n)
+{
+    int i, k;
+    struct stat st;
+    struct dep_entry *e;
+    struct ut_str dir;
+
+    str_init(&dir);
+    for (i = 0; i < n; ++i) {
+        str_clear(&dir);
+        path_dir(paths[i], &dir);
+        watch_dir(dir.s);
+
+        if (NULL == (e = dep_entry_lookup(paths[i])))
             continue;
+        for (k = 0; k < e->ndeps; ++k) {
+            str_clear(&dir);
+            /* a loop over a directory depends on its entries */
+            if (0 == stat(e->deps[k].path, &st) && S_ISDIR(st.st_mode))
+                str_append_str(&dir, e->deps[k].path);
+            else
+                path_dir(e->deps[k].path, &dir);
+            watch_dir(dir.s);
+        }
+    }
+    str_free(&dir);
+}
+
+/* 
+ * Wait for events and collect the changed paths until things settle. 
+ * A changed file also changes its directory. Returns true when events 
+ * were lost and everything has to be assumed changed.
+ */
+bool
+watch_read(struct hash_map *changed)
+{
+    int timeout = -1;
+    bool all = false;
+    char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    char *b;
+    struct pollfd pfd;
+    struct inotify_event *ev;
+    struct ut_str path, key;
+
+    str_init(&path);
+    str_init(&key);
+    pfd.fd = watch_fd;
+    pfd.events = POLLIN;
+
+    while (!stop_flag && poll(&pfd, 1, timeout) > 0) {
+        timeout = WATCH_SETTLE;
+        while ((len = read(watch_fd, buf, sizeof(buf))) > 0) {
+            for (b = buf; b < buf + len; b += sizeof(*ev) + ev->len) {
+                ev = (struct inotify_event *)b;
+                if (ev->mask & IN_Q_OVERFLOW)
+                    all = true;
+                if (ev->wd < 0 || ev->wd >= watch_nnames 
+                 || NULL == watch_names[ev->wd])
+                    continue;
+
+                /* a set, the values only have to be non NULL */
+                str_clear(&key);
+                page_path_key(watch_names[ev->wd], &key);
+                map_put(changed, key.s, changed);
+                if (0 == ev->len)
+                    continue;
 
-        struct ut_str u_s, u_d;
-        str_init(&u_d);
-        str_init(&u_s);
+                str_clear(&path);
+                str_append_str(&path, watch_names[ev->wd]);
+                str_append(&path, '/');
+                str_append_str(&path, ev->name);
+                str_clear(&key);
+                page_path_key(path.s, &key);
+                map_put(changed, key.s, changed);
+                if (verbosity > 1)
+                    printf("Changed %s\n", key.s);
+            }
+        }
+    }
 
-        str_append_str(&u_d, dest);
-        str_append_str(&u_s, src);
+    str_free(&key);
+    str_free(&path);
+    return all;
+}
 
-        str_append(&u_d, '/');
-        str_append(&u_s, '/');
+/* 
+ * Reload the changed pages in place, so inherits and includes pointing
+ * at them stay valid, and render the pages that depend on any change.
+ */
+void
+watch_cycle(char **paths, int n, struct hash_map *changed, bool all)
+{
+    int i, k, ndirty = 0;
+    char **dirty;
+    struct page *p, *last;
+    struct dep_entry *e = NULL;
+    struct timespec t0, t1;
+    struct ut_str key, err;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    str_init(&key);
+    str_init(&err);
+
+    watch_static(all ? NULL : changed);
+
+    /* listings and shell output are only kept for one build */
+    if (sh_jobs > 1)
+        pool_wait(&sh_pool);
+    map_free(&sh_memo, sh_result_free);
+    map_init(&sh_memo);
+    map_free(&dir_cache, dir_list_free);
+    map_init(&dir_cache);
+
+    /* reloading may load new pages, those are current already */
+    last = page_tail;
+    for (p = page_list; NULL != p; p = p->next) {
+        str_clear(&key);
+        page_path_key(p->src_path, &key);
+        str_clear(&err);
+        if ((all || NULL != map_get(changed, key.s)) 
+         && !page_reload(p, &err))
+            warn("%sKeeping the previous %s\n", err.s, p->src_path);
+        if (p == last)
+            break;
+    }
 
-        str_append_str(&u_d, de->d_name);
-        str_append_str(&u_s, de->d_name);
+    dirty = malloc((n + 1) * sizeof(char *));
+    for (i = 0; i < n; ++i) {
+        bool hit = all || NULL == (e = dep_entry_lookup(paths[i]));
+        str_clear(&key);
+        page_path_key(paths[i], &key);
+        hit = hit || NULL != map_get(changed, key.s);
+        for (k = 0; !hit && k < e->ndeps; ++k) {
+            str_clear(&key);
+            page_path_key(e->deps[k].path, &key);
+            hit = NULL != map_get(changed, key.s);
+        }
+        if (hit && file_exists(paths[i]))
+            dirty[ndirty++] = paths[i];
+    }
 
-        if (verbosity > 1)
-            printf("Copying %s\n", u_s.s);
-        if (DT_DIR == de->d_type) {
-            mkdir(u_d.s, 0777);
-            copy_dir(u_s.s, u_d.s);
+    count_rewritten = 0;
+    count_unchanged = 0;
+    render_pages(dirty, ndirty, watch_render_job);
+    if (sh_jobs > 1)
+        pool_wait(&sh_pool);
+    /* new includes and loops */
+    watch_deps(dirty, ndirty);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (verbosity > 0 && ndirty > 0) {
+        printf("%d rewritten, %d unchanged in %.1f ms\n", 
+                count_rewritten, count_unchanged, 
+                (t1.tv_sec - t0.tv_sec) * 1e3 
+                + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    }
+    fflush(stdout);
+
+    free(dirty);
+    str_free(&err);
+    str_free(&key);
+}
+
+/* 
+ * Copy the changed files of the static dir, or all of it when changed 
+ * is NULL. With --symlink it is always walked as a whole since links
+ * from an earlier run have to be checked.
+ */
+void
+watch_static(struct hash_map *changed)
+{
+    size_t i, len;
+    struct stat st;
+    struct ut_str dir, dest;
+
+    str_init(&dir);
+    page_path_key(conf.static_dir.s, &dir);
+    len = dir.len;
+    str_init(&dest);
+
+    for (i = 0; NULL != changed && i < changed->cap; ++i) {
+        const char *src = changed->slots[i].key;
+        if (NULL == src || 0 != strncmp(src, dir.s, len) || '/' != src[len]
+         || 0 != stat(src, &st))
+            continue;
+
+        if (STATIC_SYMLINK == static_mode) {
+            changed = NULL;
+            break;
+        }
+        str_clear(&dest);
+        str_append_str(&dest, conf.output_dir.s);
+        str_append_str(&dest, src + len);
+        if (S_ISDIR(st.st_mode)) {
+            /* only a new directory, moved in with its contents */
+            if (NULL != map_get(&watch_dirs, src))
+                continue;
+            watch_tree(src);
+            if (copy_dest_dir(dest.s))
+                copy_dir((char *)src, dest.s);
         }
         else {
-            copy_file(u_s.s, u_d.s);
+            if (verbosity > 1)
+                printf("Copying %s\n", src);
+            build_depth(dest.s);
+            if (!(STATIC_COPY == static_mode 
+                  ? copy_file((char *)src, dest.s) 
+                  : link_file((char *)src, dest.s)))
+                warn("Unable to copy %s to %s\n", src, dest.s);
         }
-        str_free(&u_s);
-        str_free(&u_d);
     }
-    closedir(d);
-    return 0;
+    if (NULL == changed 
+     && 0 != copy_dir(conf.static_dir.s, conf.output_dir.s)) {
+        warn("Unable to copy %s to %s\n", 
+                conf.static_dir.s, conf.output_dir.s);
+    }
+
+    str_free(&dest);
+    str_free(&dir);
 }
 
-int
-copy_file(char *src, char *dest)
+/* 
+ * render_job() without the up to date check, the deps are from a build
+ * ago. A new page, or one a reload brought in, may not parse at all.
+ */
+void
+watch_render_job(void *arg)
 {
-    char c;
-    FILE *s, *d;
-    if ((s = fopen(src, "r")) == NULL) 
-        return 0;
+    struct page *p = page_find(arg);
+    struct ut_str err;
+
+    str_init(&err);
+    if (page_check(p, &err))
+        render(p);
+    else
+        warn("%sNot rendering %s\n", err.s, p->src_path);
+    str_free(&err);
+}
 
-    if ((d = fopen(dest, "w")) == NULL) 
-        return 0;
+void
+stop_signal(int sig)
+{
+    (void)sig;
+    stop_flag = 1;
+}
+
+/* 
+ * Parse the source of p again and swap the result into p, the old
+ * contents go with the temporary page. When the new source can not be
+ * read or has a syntax error, or a page it needs is missing, p is left as
+ * it was and the error is added to err.
+ */
+bool
+page_reload(struct page *p, struct ut_str *err)
+{
+    struct page *np, tmp;
+
+    /* removed, or in the middle of being replaced */
+    if (!file_exists(p->src_path))
+        return true;
+    if (verbosity > 1)
+        printf("Reloading %s\n", p->src_path);
+
+    if (NULL == (np = page_slurp(p->src_path))) {
+        str_append_str(err, "Unable to read: ");
+        str_append_str(err, p->src_path);
+        str_append(err, '\n');
+        return false;
+    }
+    if (!page_check(np, err)) {
+        page_free(np);
+        return false;
+    }
+    tmp = *p;
+    *p = *np;
+    *np = tmp;
+    p->next = tmp.next;
+    p->prev = tmp.prev;
+    np->next = NULL;
+    np->prev = NULL;
+    page_free(np);
+    return true;
+}
+
+/* what src_path was last built from, NULL when it never was */
+struct dep_entry *
+dep_entry_lookup(const char *src_path)
+{
+    struct dep_entry *e;
+    struct ut_str key;
+
+    str_init(&key);
+    page_path_key(src_path, &key);
+    if (NULL == (e = map_get(&deps_next, key.s)))
+        e = map_get(&deps_prev, key.s);
+    str_free(&key);
+    return e;
+}
+
+/* "a/b/c.html" is in "a/b", "c.html" in "." */
+void
+path_dir(const char *path, struct ut_str *dir)
+{
+    const char *slash = strrchr(path, '/');
+    if (NULL == slash) 
+        str_append(dir, '.');
+    else if (slash == path)
+        str_append(dir, '/');
+    else
+        str_append_mem(dir, path, slash - path);
+}
 
-    while (!feof(s)) {
-        c = fgetc(s);
-        fputc(c, d);
+/* 
+ * Answer requests on 127.0.0.1:port one connection at a time, until 
+ * SIGINT or SIGTERM. Each connection carries a single request.
+ */
+void
+serve(int port)
+{
+    int sfd, cfd, on = 1;
+    struct sockaddr_in addr;
+    struct sigaction sa;
+
+    if (-1 == (sfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)))
+        fatal("Unable to create socket: %s\n", strerror(errno));
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (0 != bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) 
+     || 0 != listen(sfd, 64))
+        fatal("Unable to listen on port %d: %s\n", port, strerror(errno));
+
+    /* a client going away must not take the server with it */
+    signal(SIGPIPE, SIG_IGN);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    map_init(&serve_cache);
+    if (verbosity > 0)
+        printf("Serving on http://127.0.0.1:%d/, ^C to stop\n", port);
+    fflush(stdout);
+
+    while (!stop_flag) {
+        if (-1 == (cfd = accept4(sfd, NULL, NULL, SOCK_CLOEXEC))) {
+            if (EINTR != errno && EAGAIN != errno)
+                warn("Unable to accept: %s\n", strerror(errno));
+            continue;
+        }
+        serve_conn(cfd);
+        close(cfd);
+        fflush(stdout);
     }
 
-    fclose(s);
-    fclose(d);
-    return 1;
+    close(sfd);
+    map_free(&serve_cache, served_free);
 }
 
-bool 
-flook_ahead(FILE *f, char *s, int len)
+void
+serve_conn(int fd)
 {
-    int i;
-    char c;
-    long offset = 0;
-    for (i = 0; i < len; ++i) {
-        c = fgetc(f);
-        offset--;
-        if (c != s[i]) {
-            fseek(f, offset, SEEK_CUR);
-            return false;
+    char buf[SERVE_REQUEST];
+    char *method, *target, *end, *s;
+    size_t len = 0;
+    ssize_t n;
+    bool head;
+    struct timeval tv = { 5, 0 };
+    struct ut_str rel, src;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    /* only the request line matters, the headers are read and dropped */
+    buf[0] = '\0';
+    while (NULL == strstr(buf, "\r\n\r\n") && len < sizeof(buf) - 1
+        && (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+        len += n;
+        buf[len] = '\0';
+    }
+    if (NULL == (end = strstr(buf, "\r\n")))
+        return;
+    *end = '\0';
+
+    method = buf;
+    if (NULL == (s = strchr(method, ' ')))
+        goto bad;
+    *s = '\0';
+    target = s + 1;
+    if (NULL == (s = strchr(target, ' ')) || 0 != strncmp(s + 1, "HTTP/", 5))
+        goto bad;
+    *s = '\0';
+
+    head = 0 == strcmp(method, "HEAD");
+    if (!head && 0 != strcmp(method, "GET")) {
+        serve_reply(fd, "405 Method Not Allowed", "text/plain", 0, 
+                "Allow: GET, HEAD\r\n");
+        return;
+    }
+
+    str_init(&rel);
+    str_init(&src);
+    if (!serve_target(target, &rel)) {
+        str_free(&src);
+        str_free(&rel);
+        goto bad;
+    }
+    if (verbosity > 0)
+        printf("%s /%s\n", method, rel.s);
+
+    /* "/" and "/dir/" are the index page of the directory */
+    if (0 == rel.len || '/' == rel.s[rel.len - 1])
+        str_append_str(&rel, "index.html");
+
+    str_append_str(&src, rel.s);
+    if (rel.len > 5 && 0 == strcmp(rel.s + rel.len - 5, ".html") 
+     && !file_exists(src.s)) {
+        /* the output of a markdown page */
+        src.len -= 5;
+        src.s[src.len] = '\0';
+        str_append_str(&src, ".mkd");
+    }
+
+    if (rel.len > 5 && 0 == strcmp(rel.s + rel.len - 5, ".html") 
+     && file_exists(src.s)) {
+        serve_page(fd, src.s, head);
+    }
+    else if (!serve_static(fd, rel.s, head)) {
+        str_clear(&src);
+        str_append_str(&src, rel.s);
+        str_append_str(&src, "/index.html");
+        if (file_exists(src.s)) {
+            /* relative links in the index need the slash */
+            str_clear(&src);
+            str_append_str(&src, "Location: /");
+            str_append_str(&src, rel.s);
+            str_append_str(&src, "/\r\n");
+            serve_reply(fd, "301 Moved Permanently", "text/plain", 0, src.s);
+        }
+        else {
+            serve_reply(fd, "404 Not Found", "text/plain", 0, NULL);
+        }
+    }
+
+    str_free(&src);
+    str_free(&rel);
+    return;
+
+bad:
+    serve_reply(fd, "400 Bad Request", "text/plain", 0, NULL);
+}
+
+/* 
+ * Path of the request target relative to the site, without the query and
+ * with escapes decoded. Anything climbing out of the site is refused.
+ */
+bool
+serve_target(char *target, struct ut_str *rel)
+{
+    char c, hex[3] = { 0, 0, 0 };
+    char *s, *seg;
+
+    if ('/' != *target)
+        return false;
+    if (NULL != (s = strpbrk(target, "?#")))
+        *s = '\0';
+
+    for (s = target + 1; '\0' != *s; ++s) {
+        c = *s;
+        if ('%' == c && isxdigit((unsigned char)s[1]) 
+         && isxdigit((unsigned char)s[2])) {
+            hex[0] = *++s;
+            hex[1] = *++s;
+            if ('\0' == (c = (char)strtol(hex, NULL, 16)))
+                return false;
         }
+        /* no empty segments */
+        if ('/' != c || (rel->len > 0 && '/' != rel->s[rel->len - 1]))
+            str_append(rel, c);
+    }
+
+    for (seg = rel->s; NULL != seg; seg = strchr(seg, '/')) {
+        if ('/' == *seg)
+            seg++;
+        if (0 == strncmp(seg, "..", 2) && ('/' == seg[2] || '\0' == seg[2]))
+            return false;
     }
     return true;
 }
 
-bool 
-slook_ahead(char *f, char *s, int len)
+/* 
+ * Render src into memory unless the copy from an earlier request is 
+ * still current. Otherwise every loaded page that changed is parsed again
+ * first, a new page may inherit from one of them. Syntax errors and
+ * missing pages are sent as a 500 page until the source is fixed.
+ */
+void
+serve_page(int fd, const char *src, bool head)
 {
     int i;
-    for (i = 0; i < len; ++i) {
-        if (f[i] != s[i]) {
+    bool stale = always_make;
+    struct page *p;
+    struct dep_entry *e;
+    struct ut_str out, err;
+    struct served *sv = map_get(&serve_cache, src);
+
+    for (i = 0; NULL != sv && !stale && i < sv->deps->ndeps; ++i) 
+        stale = dep_stamp_changed(&sv->deps->deps[i]);
+
+    if (NULL == sv || stale) {
+        str_init(&err);
+        for (p = page_list; NULL != p; p = p->next) {
+            if (dep_stamp_changed(&p->stamp)) {
+                page_reload(p, &err);
+                stale = true;
+            }
+        }
+        /* shell output may have changed as well, listings are cheap */
+        if (stale) {
+            if (sh_jobs > 1)
+                pool_wait(&sh_pool);
+            map_free(&sh_memo, sh_result_free);
+            map_init(&sh_memo);
+        }
+        map_free(&dir_cache, dir_list_free);
+        map_init(&dir_cache);
+        served_free(sv);
+        map_put(&serve_cache, src, NULL);
+
+        if (NULL == (p = page_load((char *)src))) {
+            str_append_str(&err, "Unable to read: ");
+            str_append_str(&err, src);
+            str_append(&err, '\n');
+        }
+        if (NULL == p || !page_check(p, &err) || err.len > 0)
+            goto fail;
+
+        str_init(&out);
+        e = render_mem(p, &out, p->file_path, &err);
+        if (err.len > 0) {
+            str_free(&out);
+            dep_entry_free(e);
+            goto fail;
+        }
+        str_free(&err);
+        sv = malloc(sizeof(struct served));
+        sv->deps = e;
+        sv->len = out.len;
+        sv->body = malloc(out.len + 1);
+        memcpy(sv->body, out.s, out.len + 1);
+        str_free(&out);
+        map_put(&serve_cache, src, sv);
+    }
+
+    serve_reply(fd, "200 OK", "text/html; charset=utf-8", sv->len, NULL);
+    if (!head)
+        write_all(fd, sv->body, sv->len);
+    return;
+
+fail:
+    warn("%s", err.s);
+    serve_reply(fd, "500 Internal Server Error", 
+            "text/plain; charset=utf-8", err.len, NULL);
+    if (!head)
+        write_all(fd, err.s, err.len);
+    str_free(&err);
+}
+
+/* a file of the static dir, false when there is none */
+bool
+serve_static(int fd, const char *rel, bool head)
+{
+    int sfd;
+    off_t off = 0;
+    ssize_t n;
+    struct stat st;
+    struct ut_str path;
+
+    str_init(&path);
+    str_append_str(&path, conf.static_dir.s);
+    str_append(&path, '/');
+    str_append_str(&path, rel);
+    sfd = open(path.s, O_RDONLY | O_CLOEXEC);
+    str_free(&path);
+    if (-1 == sfd)
+        return false;
+    if (0 != fstat(sfd, &st) || !S_ISREG(st.st_mode)) {
+        close(sfd);
+        return false;
+    }
+
+    serve_reply(fd, "200 OK", serve_type(rel), st.st_size, NULL);
+    while (!head && off < st.st_size 
+        && (n = sendfile(fd, sfd, &off, st.st_size - off)) > 0)
+        ;
+    close(sfd);
+    return true;
+}
+
+/* status line and headers, extra is added as is */
+void
+serve_reply(int fd, const char *status, const char *type, size_t len, 
+            const char *extra)
+{
+    char buf[512];
+    int n = snprintf(buf, sizeof(buf), 
+            "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+            "Cache-Control: no-cache\r\nConnection: close\r\n%s\r\n", 
+            status, type, len, NULL != extra ? extra : "");
+    if (n > 0 && (size_t)n < sizeof(buf))
+        write_all(fd, buf, n);
+}
+
+const char *
+serve_type(const char *path)
+{
+    static const char *types[][2] = {
+        {".html", "text/html; charset=utf-8"},
+        {".css",  "text/css"},
+        {".js",   "text/javascript"},
+        {".json", "application/json"},
+        {".xml",  "application/xml"},
+        {".txt",  "text/plain; charset=utf-8"},
+        {".png",  "image/png"},
+        {".jpg",  "image/jpeg"},
+        {".jpeg", "image/jpeg"},
+        {".gif",  "image/gif"},
+        {".svg",  "image/svg+xml"},
+        {".ico",  "image/x-icon"},
+        {".woff", "font/woff"},
+        {".woff2", "font/woff2"},
+        {".pdf",  "application/pdf"},
+    };
+    size_t i;
+    const char *ext = strrchr(path, '.');
+
+    for (i = 0; NULL != ext && i < sizeof(types) / sizeof(types[0]); ++i) {
+        if (0 == strcasecmp(ext, types[i][0]))
+            return types[i][1];
+    }
+    return "application/octet-stream";
+}
+
+void
+served_free(void *v)
+{
+    struct served *sv = v;
+    if (NULL == sv)
+        return;
+    free(sv->body);
+    dep_entry_free(sv->deps);
+    free(sv);
+}
+
+bool
+write_all(int fd, const char *s, size_t n)
+{
+    ssize_t w;
+    while (n > 0) {
+        if ((w = write(fd, s, n)) < 0) {
+            if (EINTR == errno)
+                continue;
             return false;
         }
+        s += w;
+        n -= w;
     }
     return true;
 }
 
+uint64_t
+stats_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* 
+ * Phases nest per thread. The time of a phase stops counting while a
+ * nested one runs, so the times of all phases add up to the time the
+ * threads spent in any of them. arg names the page, command or 
+ * directory in the trace and has to live until phase_end().
+ */
 void
-warn(const char *fmt, ...)
+phase_begin(int phase, const char *arg)
 {
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
+    uint64_t now;
+    struct phase_frame *f;
+
+    if (!timing)
+        return;
+    if (phase_depth++ >= PHASE_DEPTH)
+        return;
+
+    now = stats_now();
+    if (phase_depth > 1) {
+        f = &phase_stack[phase_depth - 2];
+        __atomic_add_fetch(&phase_ns[f->phase], now - f->resume, 
+                __ATOMIC_RELAXED);
+    }
+    f = &phase_stack[phase_depth - 1];
+    f->phase = phase;
+    f->arg = arg;
+    f->start = now;
+    f->resume = now;
 }
 
-void 
-fatal(const char *fmt, ...)
+/* ends the innermost phase, returns how long it took with nested ones */
+uint64_t
+phase_end()
 {
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    exit(EXIT_FAILURE);
+    uint64_t now;
+    struct phase_frame *f;
+
+    if (!timing)
+        return 0;
+    if (--phase_depth >= PHASE_DEPTH)
+        return 0;
+
+    now = stats_now();
+    f = &phase_stack[phase_depth];
+    __atomic_add_fetch(&phase_ns[f->phase], now - f->resume, 
+            __ATOMIC_RELAXED);
+    __atomic_add_fetch(&phase_count[f->phase], 1, __ATOMIC_RELAXED);
+    if (phase_depth > 0)
+        phase_stack[phase_depth - 1].resume = now;
+    if (NULL != trace_file)
+        trace_event(f->phase, f->arg, f->start, now);
+
+    return now - f->start;
+}
+
+/* remember path if it is among the slowest renders so far */
+void
+stats_page(const char *path, uint64_t ns)
+{
+    int i;
+
+    if (!stats_mode || stats_slowest < 1)
+        return;
+
+    pthread_mutex_lock(&stats_lock);
+    if (NULL == slow_pages)
+        slow_pages = calloc(stats_slowest, sizeof(struct slow_page));
+    if (slow_npages < stats_slowest || ns > slow_pages[slow_npages - 1].ns) {
+        if (slow_npages == stats_slowest)
+            free(slow_pages[--slow_npages].path);
+        for (i = slow_npages; i > 0 && slow_pages[i - 1].ns < ns; --i) 
+            slow_pages[i] = slow_pages[i - 1];
+        slow_pages[i].path = strdup(path);
+        slow_pages[i].ns = ns;
+        slow_npages++;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void
+stats_print()
+{
+    int i;
+    uint64_t sum = 0;
+
+    printf("%-10s %10s %8s\n", "phase", "ms", "count");
+    for (i = 0; i < PH_COUNT; ++i) {
+        sum += phase_ns[i];
+        printf("%-10s %10.1f %8ld\n", phase_names[i], phase_ns[i] / 1e6, 
+                phase_count[i]);
+    }
+    printf("%-10s %10.1f\n", "threads", sum / 1e6);
+    printf("%-10s %10.1f\n", "wall", (stats_now() - stats_start) / 1e6);
+
+    printf("%ld pages parsed, page_find %ld hits %ld misses, "
+            "%ld shell blocks run, %lld bytes written\n",
+            phase_count[PH_READ], stats_find_hits, stats_find_misses,
+            stats_shells, stats_bytes);
+
+    if (slow_npages > 0)
+        printf("slowest pages:\n");
+    for (i = 0; i < slow_npages; ++i) {
+        printf("%10.1f ms  %s\n", slow_pages[i].ns / 1e6, 
+                slow_pages[i].path);
+        free(slow_pages[i].path);
+    }
+    free(slow_pages);
+    slow_pages = NULL;
+    slow_npages = 0;
+}
+
+/* 
+ * Chrome trace event format, one complete event per phase. Events are
+ * written as phases end, so nested ones come before their parents.
+ */
+void
+trace_open(const char *path)
+{
+    if (NULL == (trace_file = fopen(path, "w")))
+        fatal("Unable to write: %s\n", path);
+    fputs("{\"traceEvents\":[", trace_file);
+}
+
+void
+trace_event(int phase, const char *arg, uint64_t start, uint64_t end)
+{
+    long tid = syscall(SYS_gettid);
+
+    pthread_mutex_lock(&trace_lock);
+    fputs(trace_first ? "\n" : ",\n", trace_file);
+    trace_first = false;
+    fputs("{\"name\":", trace_file);
+    json_quote(trace_file, NULL != arg ? arg : phase_names[phase]);
+    fprintf(trace_file, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+            "\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f}", phase_names[phase], 
+            (int)getpid(), tid, (start - stats_start) / 1e3, 
+            (end - start) / 1e3);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void
+trace_close()
+{
+    if (NULL == trace_file)
+        return;
+    fputs("\n],\"displayTimeUnit\":\"ms\"}\n", trace_file);
+    if (0 != fclose(trace_file))
+        warn("Unable to write trace\n");
+    trace_file = NULL;
+}
+
+void
+json_quote(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; '\0' != *s; ++s) {
+        if ('"' == *s || '\\' == *s)
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
 }
 
 int
 main (int argc, char **argv)
 {
-    int c;
+    int c, first;
 
+    stats_start = stats_now();
     while (true)
     {
         static struct option long_options[] =
         {
+            {"always-make", no_argument, NULL, (int)'B'},
+            {"jobs",    required_argument, NULL, (int)'j'},
+            {"link",    no_argument, NULL, (int)'L'},
+            {"symlink", no_argument, NULL, (int)'S'},
+            {"sh-cache", no_argument, NULL, (int)'C'},
+            {"coproc",  no_argument, NULL, (int)'P'},
+            {"sh-jobs", required_argument, NULL, (int)'J'},
+            {"engine",  required_argument, NULL, (int)'E'},
+            {"native",  no_argument, NULL, (int)'N'},
+            {"watch",   no_argument, NULL, (int)'W'},
+            {"serve",   required_argument, NULL, (int)'R'},
+            {"stats",   optional_argument, NULL, (int)'Z'},
+            {"trace",   required_argument, NULL, (int)'T'},
             {"verbose", no_argument, NULL, (int)'v'},
             {"version", no_argument, NULL, (int)'V'},
             {"quiet",   no_argument, NULL, (int)'q'},
@@ -1357,7 +5618,7 @@ main (int argc, char **argv)
         /* getopt_long stores the option index here. */
         int option_index = 0;
 
-        c = getopt_long (argc, argv, "hqvV", long_options, &option_index);
+        c = getopt_long (argc, argv, "Bhj:qvV", long_options, &option_index);
 
         /* Detect the end of the options. */
         if (c == -1)
@@ -1371,6 +5632,61 @@ main (int argc, char **argv)
             case 'V':
                 version();
                 break;
+            case 'B':
+                always_make = true;
+                break;
+            case 'L':
+                static_mode = STATIC_LINK;
+                break;
+            case 'S':
+                static_mode = STATIC_SYMLINK;
+                break;
+            case 'C':
+                sh_cache = true;
+                break;
+            case 'P':
+                sh_coproc = true;
+                break;
+            case 'N':
+                native_mode = true;
+                break;
+            case 'W':
+                watch_mode = true;
+                break;
+            case 'Z':
+                stats_mode = true;
+                if (NULL != optarg) {
+                    stats_slowest = atoi(optarg);
+                    if (stats_slowest < 0)
+                        fatal("Invalid number of pages: %s\n", optarg);
+                }
+                break;
+            case 'T':
+                trace_open(optarg);
+                break;
+            case 'R':
+                serve_port = atoi(optarg);
+                if (serve_port < 1 || serve_port > 65535)
+                    fatal("Invalid port: %s\n", optarg);
+                break;
+            case 'E':
+                if (0 == strcmp(optarg, "vm"))
+                    engine = ENGINE_VM;
+                else if (0 == strcmp(optarg, "tree"))
+                    engine = ENGINE_TREE;
+                else
+                    fatal("Unknown engine: %s\n", optarg);
+                break;
+            case 'J':
+                sh_jobs = atoi(optarg);
+                if (sh_jobs < 1)
+                    fatal("Invalid number of shell jobs: %s\n", optarg);
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs < 1)
+                    fatal("Invalid number of jobs: %s\n", optarg);
+                break;
             case 'q':
                 quiet_flag = true;
                 break;
@@ -1384,18 +5700,81 @@ main (int argc, char **argv)
     if (quiet_flag) {
         verbosity = 0;
     }
+    timing = stats_mode || NULL != trace_file;
+
+    /* "./posts/a.html" and "posts//a.html" both write into posts */
+    map_init(&page_dirs);
+    for (c = optind; c < argc; ++c) {
+        struct ut_str key;
+        char *slash;
+
+        str_init(&key);
+        page_path_key(argv[c], &key);
+        if (NULL != (slash = strchr(key.s, '/'))) {
+            *slash = '\0';
+            map_put(&page_dirs, key.s, argv[c]);
+        }
+        str_free(&key);
+    }
+
+    if (sh_coproc) {
+        /* a dead coprocess is noticed by its pipe, not by a signal */
+        signal(SIGPIPE, SIG_IGN);
+        coproc_max = jobs + (sh_jobs > 1 ? sh_jobs : 0);
+    }
 
     setup();
+    sym_init();
+    map_init(&sh_memo);
+    map_init(&dir_cache);
     page_list_init();
+    if (sh_jobs > 1)
+        pool_init(&sh_pool, sh_jobs);
 
-    if (optind < argc) {
-        while (optind < argc) {
-            char *s = argv[optind++];
-            struct page *p = page_find(s);
-            render(p);
+    if (serve_port > 0) {
+        serve(serve_port);
+    }
+    else {
+        phase_begin(PH_DEPS, NULL);
+        deps_load();
+        phase_end();
+        first = optind;
+        if (optind < argc)
+            mkd_prepass(argv + optind, argc - optind);
+
+        render_pages(argv + first, argc - first, render_job);
+        if (sh_jobs > 1) {
+            /* blocks in loops that never ran may still be going */
+            pool_wait(&sh_pool);
+        }
+        if (verbosity > 0 && count_rewritten + count_unchanged > 0) {
+            printf("%d rewritten, %d unchanged\n", 
+                    count_rewritten, count_unchanged);
         }
+        if (watch_mode)
+            watch(argv + first, argc - first);
+        phase_begin(PH_DEPS, NULL);
+        deps_save();
+        phase_end();
     }
+    if (sh_jobs > 1) {
+        pool_wait(&sh_pool);
+        pool_free(&sh_pool);
+    }
+    trace_close();
+    if (stats_mode)
+        stats_print();
     page_list_free();
+    sym_free();
+    map_free(&page_dirs, NULL);
+    map_free(&sh_memo, sh_result_free);
+    map_free(&dir_cache, dir_list_free);
+    coproc_free_all();
+    native_free();
+    if (NULL != thread_arena) {
+        arena_free(thread_arena);
+        free(thread_arena);
+    }
 
     return 0;
 }
@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# coproc.sh: kills the shell of --coproc in the middle of a build. The
+# block that killed it fails, every other block of the page still runs on
+# a new shell and the build ends.
+#
+#   coproc.sh [lacy]
+
+lacy=${1:-./lacy}
+case $lacy in /*) ;; *) lacy=$(pwd)/$lacy ;; esac
+
+site=$(mktemp -d "${TMPDIR:-/tmp}/lacy-test.XXXXXX")
+trap 'rm -rf "$site"' EXIT INT TERM
+cd "$site"
+mkdir _static
+cat > page.html <<'END'
+a {$ echo one $}
+b {$ kill -9 $$; echo two $}
+c {$ echo four $}
+END
+
+fail() {
+    echo "coproc.sh: $*" >&2
+    exit 1
+}
+
+# a lost coprocess used to leave lacy waiting for a free one forever
+"$lacy" -q --coproc --sh-jobs=1 page.html 2>/dev/null &
+pid=$!
+i=0
+while kill -0 $pid 2>/dev/null; do
+    i=$((i + 1))
+    if [ $i -gt 100 ]; then
+        kill -9 $pid
+        fail "build did not finish"
+    fi
+    sleep 0.1
+done
+wait $pid || fail "build failed"
+
+grep -q '^a one$' _output/page.html || fail "block before the kill is missing"
+grep -q '^c four$' _output/page.html || fail "block after the kill is missing"
+grep -q two _output/page.html && fail "killed block has output"
+echo "coproc.sh: ok"